@@ -65,6 +65,26 @@ int ei_x_decode_tuple_header(ei_x_buff *x, int *arity)
     return ei_decode_tuple_header(x->buff, &x->index, arity);
 }
 
+int ei_x_decode_list_header(ei_x_buff *x, int *arity)
+{
+    return ei_decode_list_header(x->buff, &x->index, arity);
+}
+
+int ei_x_get_type(ei_x_buff *x, int *type, int *size)
+{
+    return ei_get_type(x->buff, &x->index, type, size);
+}
+
+int ei_x_decode_binary(ei_x_buff *x, void *b, long *len)
+{
+    return ei_decode_binary(x->buff, &x->index, b, len);
+}
+
+int ei_x_decode_double(ei_x_buff *x, double *d)
+{
+    return ei_decode_double(x->buff, &x->index, d);
+}
+
 int ei_x_decode_long(ei_x_buff *x, long *n)
 {
     return ei_decode_long(x->buff, &x->index, n);
@@ -40,6 +40,10 @@ int ei_x_decode_version(ei_x_buff *x, int *version);
 int ei_x_decode_atom(ei_x_buff *x, char *atom);
 int ei_x_decode_term(ei_x_buff *x, void *term);
 int ei_x_decode_tuple_header(ei_x_buff *x, int *arity);
+int ei_x_decode_list_header(ei_x_buff *x, int *arity);
+int ei_x_get_type(ei_x_buff *x, int *type, int *size);
+int ei_x_decode_binary(ei_x_buff *x, void *b, long *len);
+int ei_x_decode_double(ei_x_buff *x, double *d);
 int ei_x_decode_long(ei_x_buff *x, long *n);
 int ei_x_decode_longlong(ei_x_buff *x, long long *n);
 int ei_x_decode_ulong(ei_x_buff *x, unsigned long *n);
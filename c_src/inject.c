@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2016, Mark Jones <markalanj@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * The names of its contributors may not be used to endorse or promote
+ * products derived from this software without specific prior written
+ * permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <math.h>
+#include <string.h>
+#include "inject.h"
+
+#define DEFAULT_SEED    0x9e3779b97f4a7c15ULL
+#define TWO_PI          6.28318530717958647692
+
+void inject_init(injector *inj, uint64_t seed)
+{
+    memset(inj, 0, sizeof(*inj));
+    inj->state = seed ? seed : DEFAULT_SEED;
+    inj->delay = DELAY_NONE;
+    inj->delay_fd = -1;
+    inj->epoch = -1;
+}
+
+static uint64_t next_random(injector *inj)
+{
+    inj->state ^= inj->state >> 12;
+    inj->state ^= inj->state << 25;
+    inj->state ^= inj->state >> 27;
+    return inj->state * 0x2545f4914f6cdd1dULL;
+}
+
+/* Uniform in [0, 1) */
+static double next_uniform(injector *inj)
+{
+    return (next_random(inj) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Standard normal, Box-Muller */
+static double next_normal(injector *inj)
+{
+    double u = 1.0 - next_uniform(inj);
+    double v = next_uniform(inj);
+
+    return sqrt(-2.0 * log(u)) * cos(TWO_PI * v);
+}
+
+/* Decide what happens to a tick that fired at now. Random numbers are drawn
+ * in the same order for every tick so a seed always gives the same
+ * sequence of decisions. */
+void inject_tick(injector *inj, int64_t now, inject_action *action)
+{
+    double drop = next_uniform(inj);
+    double burst = next_uniform(inj);
+    double delay = 0.0;
+    int64_t phase;
+
+    switch(inj->delay)
+    {
+    case DELAY_UNIFORM:
+        delay = inj->delay_a + (inj->delay_b - inj->delay_a)
+            * next_uniform(inj);
+        break;
+    case DELAY_LOGNORMAL:
+        delay = exp(inj->delay_a + inj->delay_b * next_normal(inj));
+        break;
+    }
+
+    /* A lognormal tail can reach infinity */
+    if(!(delay < INJECT_MAX_DELAY))
+        delay = INJECT_MAX_DELAY;
+
+    action->drop = drop < inj->drop;
+    action->delay = (int64_t)(delay * 1000.0);
+    action->extra = 0;
+
+    if(action->drop)
+    {
+        inj->drops++;
+        return;
+    }
+
+    /* Ticks falling into the stall at the start of each period are held
+     * until the stall ends */
+    if(inj->stall_period > 0)
+    {
+        if(inj->epoch < 0)
+            inj->epoch = now;
+        phase = (now - inj->epoch) % inj->stall_period;
+        if(phase < inj->stall_duration)
+            action->delay += inj->stall_duration - phase;
+    }
+
+    if(action->delay > 0)
+        inj->delays++;
+
+    if(burst < inj->burst)
+    {
+        action->extra = inj->burst_count;
+        inj->bursts++;
+    }
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2016, Mark Jones <markalanj@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * The names of its contributors may not be used to endorse or promote
+ * products derived from this software without specific prior written
+ * permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef INJECT_H
+#define INJECT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Longest delay or stall injected, in us */
+#define INJECT_MAX_DELAY    3600e6
+
+enum
+{
+    DELAY_NONE,
+    DELAY_UNIFORM,
+    DELAY_LOGNORMAL
+};
+
+typedef struct
+{
+    uint64_t state;             /* xorshift64* */
+    double drop;                /* probability */
+    int delay;
+    double delay_a;             /* uniform min us or lognormal mu */
+    double delay_b;             /* uniform max us or lognormal sigma */
+    int64_t stall_period;       /* ns */
+    int64_t stall_duration;     /* ns */
+    double burst;               /* probability */
+    unsigned long burst_count;  /* extra expirations per burst */
+    int64_t epoch;              /* ns, start of the first stall period */
+    int delay_fd;               /* one-shot timerfd for delayed ticks */
+    bool delaying;
+    int64_t delayed_deadline;   /* deadline of the tick being delayed */
+    unsigned long drops;
+    unsigned long delays;
+    unsigned long bursts;
+} injector;
+
+typedef struct
+{
+    bool drop;
+    int64_t delay;              /* ns */
+    unsigned long extra;        /* expirations */
+} inject_action;
+
+void inject_init(injector *inj, uint64_t seed);
+void inject_tick(injector *inj, int64_t now, inject_action *action);
+
+#endif
+
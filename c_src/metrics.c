@@ -0,0 +1,611 @@
+/*
+ * Copyright (c) 2016, Mark Jones <markalanj@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * The names of its contributors may not be used to endorse or promote
+ * products derived from this software without specific prior written
+ * permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <erl_driver.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "logger.h"
+#include "metrics.h"
+
+#define SNIFF_TIMEOUT   10      /* ms to wait for an HTTP request */
+#define SEND_TIMEOUT    1000    /* ms a client may take to read a scrape */
+#define PATH_LEN        256
+
+static const int64_t lateness_bounds[METRICS_HIST_BUCKETS - 1] =
+{
+    1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000,
+    1000000, 2000000, 5000000, 10000000
+};
+
+static const char *lateness_labels[METRICS_HIST_BUCKETS] =
+{
+    "1e-06", "2e-06", "5e-06", "1e-05", "2e-05", "5e-05", "0.0001",
+    "0.0002", "0.0005", "0.001", "0.002", "0.005", "0.01", "+Inf"
+};
+
+typedef struct
+{
+    bool running;
+    int kind;
+    char path[PATH_LEN];
+    unsigned long interval;     /* ms, file export only */
+    int listen_fd;
+    int wake_fd[2];
+    ErlDrvTid tid;
+    unsigned long scrapes;
+    int64_t scrape_duration;    /* ns, last scrape */
+} exporter;
+
+static ErlDrvMutex *export_lock;
+static ErlDrvMutex *registry_lock;
+static timer_metrics *registry;
+static unsigned long next_id;
+static exporter export;
+
+void metrics_init(void)
+{
+    export_lock = erl_drv_mutex_create("timerfd_export");
+    registry_lock = erl_drv_mutex_create("timerfd_metrics");
+    registry = NULL;
+    next_id = 1;
+    memset(&export, 0, sizeof(export));
+}
+
+void metrics_finish(void)
+{
+    metrics_export_stop();
+    erl_drv_mutex_destroy(registry_lock);
+    erl_drv_mutex_destroy(export_lock);
+}
+
+void metrics_register(timer_metrics *m)
+{
+    erl_drv_mutex_lock(registry_lock);
+    m->id = next_id++;
+    m->prev = NULL;
+    m->next = registry;
+    if(registry)
+        registry->prev = m;
+    registry = m;
+    erl_drv_mutex_unlock(registry_lock);
+}
+
+void metrics_unregister(timer_metrics *m)
+{
+    erl_drv_mutex_lock(registry_lock);
+    if(m->prev)
+        m->prev->next = m->next;
+    else
+        registry = m->next;
+    if(m->next)
+        m->next->prev = m->prev;
+    erl_drv_mutex_unlock(registry_lock);
+}
+
+/* Returns 0 and the id of the timer named name, or -1 */
+int metrics_find(const char *name, unsigned long *id)
+{
+    timer_metrics *m;
+
+    erl_drv_mutex_lock(registry_lock);
+    for(m = registry; m && strcmp(m->name, name) != 0; m = m->next)
+        ;
+    if(m)
+        *id = m->id;
+    erl_drv_mutex_unlock(registry_lock);
+
+    return m ? 0 : -1;
+}
+
+/* Adjust the native subscriber count of a timer, -1 if there is no such
+ * timer */
+int metrics_add_subscriber(unsigned long id, int delta)
+{
+    timer_metrics *m;
+
+    erl_drv_mutex_lock(registry_lock);
+    for(m = registry; m && m->id != id; m = m->next)
+        ;
+    if(m)
+        METRIC_ADD(m->subscribers, delta);
+    erl_drv_mutex_unlock(registry_lock);
+
+    return m ? 0 : -1;
+}
+
+void metrics_set_name(timer_metrics *m, const char *name)
+{
+    erl_drv_mutex_lock(registry_lock);
+    strncpy(m->name, name, sizeof(m->name) - 1);
+    erl_drv_mutex_unlock(registry_lock);
+}
+
+void metrics_observe_lateness(timer_metrics *m, int64_t lateness)
+{
+    int i;
+
+    if(lateness < 0)
+        lateness = 0;
+
+    for(i = 0; i < METRICS_HIST_BUCKETS - 1; i++)
+        if(lateness <= lateness_bounds[i])
+            break;
+
+    METRIC_ADD(m->lateness[i], 1);
+    METRIC_ADD(m->lateness_sum, lateness);
+    if(lateness > METRIC_GET(m->lateness_max))
+        METRIC_SET(m->lateness_max, lateness);
+    if(m->slo > 0 && lateness > m->slo)
+        METRIC_ADD(m->slo_violations, 1);
+}
+
+static int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void print_labels(FILE *fp, timer_metrics *m)
+{
+    const char *c;
+
+    fprintf(fp, "{id=\"%lu\",name=\"", m->id);
+    for(c = m->name; *c; c++)
+    {
+        if(*c == '"' || *c == '\\')
+            fputc('\\', fp);
+        fputc(*c, fp);
+    }
+    fputc('"', fp);
+}
+
+static void print_counter(FILE *fp, timer_metrics *list, size_t n,
+                          const char *name, const char *help, size_t offset)
+{
+    timer_metrics *m;
+
+    fprintf(fp, "# TYPE %s counter\n# HELP %s %s\n", name, name, help);
+    for(m = list; m < list + n; m++)
+    {
+        fprintf(fp, "%s_total", name);
+        print_labels(fp, m);
+        fprintf(fp, "} %lu\n",
+                METRIC_GET(*(unsigned long *)((char *)m + offset)));
+    }
+}
+
+/* Format the n timers of list in OpenMetrics text format */
+static void print_metrics(FILE *fp, timer_metrics *list, size_t n)
+{
+    timer_metrics *m;
+    unsigned long count;
+    int i;
+
+    print_counter(fp, list, n, "timerfd_ticks", "Ready events delivered.",
+                  offsetof(timer_metrics, ticks));
+    print_counter(fp, list, n, "timerfd_expirations", "Expirations read.",
+                  offsetof(timer_metrics, expirations));
+    print_counter(fp, list, n, "timerfd_async_requests",
+                  "Asynchronous settime requests received.",
+                  offsetof(timer_metrics, async_requests));
+    print_counter(fp, list, n, "timerfd_async_queue_full",
+                  "Asynchronous settime queue overflows.",
+                  offsetof(timer_metrics, async_queue_full));
+
+    fprintf(fp, "# TYPE timerfd_lateness_seconds histogram\n"
+            "# HELP timerfd_lateness_seconds "
+            "Time from expiration to driver wakeup.\n");
+    for(m = list; m < list + n; m++)
+    {
+        count = 0;
+        for(i = 0; i < METRICS_HIST_BUCKETS; i++)
+        {
+            count += METRIC_GET(m->lateness[i]);
+            fprintf(fp, "timerfd_lateness_seconds_bucket");
+            print_labels(fp, m);
+            fprintf(fp, ",le=\"%s\"} %lu\n", lateness_labels[i], count);
+        }
+        fprintf(fp, "timerfd_lateness_seconds_count");
+        print_labels(fp, m);
+        fprintf(fp, "} %lu\n", count);
+        fprintf(fp, "timerfd_lateness_seconds_sum");
+        print_labels(fp, m);
+        fprintf(fp, "} %.9f\n", METRIC_GET(m->lateness_sum) / 1e9);
+    }
+
+    fprintf(fp, "# TYPE timerfd_lateness_max_seconds gauge\n");
+    for(m = list; m < list + n; m++)
+    {
+        fprintf(fp, "timerfd_lateness_max_seconds");
+        print_labels(fp, m);
+        fprintf(fp, "} %.9f\n", METRIC_GET(m->lateness_max) / 1e9);
+    }
+
+    fprintf(fp, "# TYPE timerfd_lateness_slo_seconds gauge\n"
+            "# HELP timerfd_lateness_slo_seconds "
+            "Lateness objective, 0 when not set.\n");
+    for(m = list; m < list + n; m++)
+    {
+        fprintf(fp, "timerfd_lateness_slo_seconds");
+        print_labels(fp, m);
+        fprintf(fp, "} %.9f\n", METRIC_GET(m->slo) / 1e9);
+    }
+    print_counter(fp, list, n, "timerfd_lateness_slo_violations",
+                  "Wakeups later than the lateness objective.",
+                  offsetof(timer_metrics, slo_violations));
+
+    fprintf(fp, "# TYPE timerfd_scrapes counter\n"
+            "timerfd_scrapes_total %lu\n"
+            "# TYPE timerfd_scrape_duration_seconds gauge\n"
+            "# HELP timerfd_scrape_duration_seconds "
+            "Time spent on the previous scrape.\n"
+            "timerfd_scrape_duration_seconds %.9f\n"
+            "# EOF\n",
+            export.scrapes, export.scrape_duration / 1e9);
+}
+
+static void copy_metrics(timer_metrics *dst, timer_metrics *src)
+{
+    int i;
+
+    memset(dst, 0, sizeof(*dst));
+    dst->id = src->id;
+    memcpy(dst->name, src->name, sizeof(dst->name));
+    dst->ticks = METRIC_GET(src->ticks);
+    dst->expirations = METRIC_GET(src->expirations);
+    dst->async_requests = METRIC_GET(src->async_requests);
+    dst->async_batches = METRIC_GET(src->async_batches);
+    dst->async_max_batch = METRIC_GET(src->async_max_batch);
+    dst->async_queue_full = METRIC_GET(src->async_queue_full);
+    dst->async_errors = METRIC_GET(src->async_errors);
+    for(i = 0; i < METRICS_HIST_BUCKETS; i++)
+        dst->lateness[i] = METRIC_GET(src->lateness[i]);
+    dst->lateness_sum = METRIC_GET(src->lateness_sum);
+    dst->lateness_max = METRIC_GET(src->lateness_max);
+    dst->slo = METRIC_GET(src->slo);
+    dst->slo_violations = METRIC_GET(src->slo_violations);
+    dst->subscribers = METRIC_GET(src->subscribers);
+}
+
+/* Copy what is exported of every timer, so formatting does not hold up
+ * timers being opened and closed. Returns false when out of memory. */
+static bool snapshot_registry(timer_metrics **list, size_t *n)
+{
+    timer_metrics *m;
+    size_t i = 0;
+
+    erl_drv_mutex_lock(registry_lock);
+    for(*n = 0, m = registry; m; m = m->next)
+        (*n)++;
+    *list = *n > 0 ? malloc(*n * sizeof(timer_metrics)) : NULL;
+    if(*list)
+        for(m = registry; m; m = m->next)
+            copy_metrics(&(*list)[i++], m);
+    erl_drv_mutex_unlock(registry_lock);
+
+    return *n == 0 || *list != NULL;
+}
+
+static char *format_metrics(size_t *len)
+{
+    timer_metrics *list;
+    char *buf = NULL;
+    size_t n;
+    FILE *fp;
+
+    if(!snapshot_registry(&list, &n))
+        return NULL;
+
+    if(!(fp = open_memstream(&buf, len)))
+    {
+        free(list);
+        return NULL;
+    }
+
+    print_metrics(fp, list, n);
+    free(list);
+
+    if(fclose(fp) != 0)
+    {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while(len > 0)
+    {
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+        if(n < 0 && errno == ENOTSOCK)
+            n = write(fd, buf, len);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Write to a temporary file and rename it over the target so readers never
+ * see a partial file */
+static void scrape_file(void)
+{
+    char tmp[sizeof(export.path) + 4];
+    size_t len;
+    char *buf;
+    int fd;
+
+    if(!(buf = format_metrics(&len)))
+        return;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", export.path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd >= 0)
+    {
+        if(write_all(fd, buf, len) == 0 && close(fd) == 0)
+            rename(tmp, export.path);
+        else
+            unlink(tmp);
+    }
+    else
+    {
+        LOGGER_PRINT("cannot open %s", tmp);
+    }
+    free(buf);
+}
+
+/* Answer HTTP clients with an HTTP response and anything else, such as a
+ * plain socket reader, with the bare metrics */
+static void scrape_socket(int fd)
+{
+    static const char header[] =
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: application/openmetrics-text; version=1.0.0; "
+        "charset=utf-8\r\n\r\n";
+    struct pollfd pfd = {fd, POLLIN, 0};
+    struct timeval timeout = {SEND_TIMEOUT / 1000,
+                              SEND_TIMEOUT % 1000 * 1000};
+    char request[4];
+    size_t len;
+    char *buf;
+
+    /* A client that never reads must not hold up the export thread, and
+     * with it driver unload */
+    if(setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                  sizeof(timeout)) != 0)
+        return;
+
+    if(!(buf = format_metrics(&len)))
+        return;
+
+    if(poll(&pfd, 1, SNIFF_TIMEOUT) == 1
+       && recv(fd, request, sizeof(request), MSG_PEEK) == 4
+       && memcmp(request, "GET ", 4) == 0)
+        write_all(fd, header, sizeof(header) - 1);
+
+    write_all(fd, buf, len);
+    free(buf);
+}
+
+static void *export_thread(void *arg)
+{
+    struct pollfd pfd[2];
+    int64_t start;
+    int fd;
+
+    pfd[0].fd = export.wake_fd[0];
+    pfd[0].events = POLLIN;
+    pfd[1].fd = export.listen_fd;
+    pfd[1].events = POLLIN;
+
+    for(;;)
+    {
+        if(export.kind == EXPORT_FILE)
+        {
+            start = monotonic_ns();
+            scrape_file();
+            export.scrapes++;
+            export.scrape_duration = monotonic_ns() - start;
+            if(poll(pfd, 1, export.interval) != 0)
+                break;
+        }
+        else
+        {
+            if(poll(pfd, 2, -1) < 0 && errno != EINTR)
+                break;
+            if(pfd[0].revents)
+                break;
+            if(!(pfd[1].revents & POLLIN))
+                continue;
+
+            fd = accept(export.listen_fd, NULL, NULL);
+            if(fd < 0)
+                continue;
+            start = monotonic_ns();
+            scrape_socket(fd);
+            close(fd);
+            export.scrapes++;
+            export.scrape_duration = monotonic_ns() - start;
+        }
+    }
+
+    LOGGER_PRINT("export thread exiting");
+    return NULL;
+}
+
+static int listen_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* Only replace a stale socket, never some other file */
+    if(lstat(path, &st) == 0)
+    {
+        if(!S_ISSOCK(st.st_mode))
+        {
+            errno = EEXIST;
+            return -1;
+        }
+        unlink(path);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        return -1;
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+       || listen(fd, 8) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Start exporting to path, either as a file rewritten every interval
+ * milliseconds or as a UNIX domain socket answering each connection. Returns
+ * 0 or an errno value. */
+int metrics_export_start(int kind, const char *path, unsigned long interval)
+{
+    int err;
+
+    if(strlen(path) >= sizeof(export.path))
+        return ENAMETOOLONG;
+
+    erl_drv_mutex_lock(export_lock);
+    if(export.running)
+    {
+        err = EALREADY;
+        goto done;
+    }
+
+    export.kind = kind;
+    export.interval = interval;
+    export.listen_fd = -1;
+    export.scrapes = 0;
+    export.scrape_duration = 0;
+    strcpy(export.path, path);
+
+    if(kind == EXPORT_UNIX && (export.listen_fd = listen_unix(path)) < 0)
+    {
+        err = errno;
+        goto done;
+    }
+
+    if(pipe(export.wake_fd) != 0)
+    {
+        err = errno;
+        goto fail_pipe;
+    }
+
+    if((err = erl_drv_thread_create("timerfd_export", &export.tid,
+                                    export_thread, NULL, NULL)) != 0)
+        goto fail_thread;
+
+    export.running = true;
+    LOGGER_PRINT("exporting metrics to %s", path);
+    goto done;
+
+fail_thread:
+    close(export.wake_fd[0]);
+    close(export.wake_fd[1]);
+fail_pipe:
+    if(export.listen_fd >= 0)
+    {
+        close(export.listen_fd);
+        unlink(path);
+    }
+done:
+    erl_drv_mutex_unlock(export_lock);
+    return err;
+}
+
+/* Returns true if an export was running */
+bool metrics_export_stop(void)
+{
+    bool stopped;
+
+    erl_drv_mutex_lock(export_lock);
+    stopped = export.running;
+    if(export.running)
+    {
+        if(write(export.wake_fd[1], "", 1) != 1)
+            LOGGER_PRINT("failed to wake export thread");
+        erl_drv_thread_join(export.tid, NULL);
+
+        close(export.wake_fd[0]);
+        close(export.wake_fd[1]);
+        if(export.listen_fd >= 0)
+        {
+            close(export.listen_fd);
+            unlink(export.path);
+        }
+        export.running = false;
+        LOGGER_PRINT("metrics export stopped");
+    }
+    erl_drv_mutex_unlock(export_lock);
+    return stopped;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2016, Mark Jones <markalanj@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * The names of its contributors may not be used to endorse or promote
+ * products derived from this software without specific prior written
+ * permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define METRICS_NAME_LEN        256
+#define METRICS_HIST_BUCKETS    14
+
+/* Counters are written by the port owning the timer and read by the export
+ * thread without taking the port lock */
+#define METRIC_ADD(x, n)        __atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+#define METRIC_SET(x, n)        __atomic_store_n(&(x), (n), __ATOMIC_RELAXED)
+#define METRIC_GET(x)           __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+typedef struct timer_metrics
+{
+    struct timer_metrics *prev;
+    struct timer_metrics *next;
+    unsigned long id;
+    char name[METRICS_NAME_LEN];
+    unsigned long ticks;
+    unsigned long expirations;
+    unsigned long async_requests;
+    unsigned long async_batches;
+    unsigned long async_max_batch;
+    unsigned long async_queue_full;
+    unsigned long async_errors;
+    /* Wakeup lateness, each bucket counting values up to its bound */
+    unsigned long lateness[METRICS_HIST_BUCKETS];
+    uint64_t lateness_sum;  /* ns */
+    int64_t lateness_max;   /* ns */
+    int64_t slo;            /* ns, 0 when not set */
+    unsigned long slo_violations;
+    unsigned long subscribers;  /* native subscribers */
+} timer_metrics;
+
+enum
+{
+    EXPORT_FILE,
+    EXPORT_UNIX
+};
+
+void metrics_init(void);
+void metrics_finish(void);
+void metrics_register(timer_metrics *m);
+void metrics_unregister(timer_metrics *m);
+int metrics_find(const char *name, unsigned long *id);
+int metrics_add_subscriber(unsigned long id, int delta);
+void metrics_set_name(timer_metrics *m, const char *name);
+void metrics_observe_lateness(timer_metrics *m, int64_t lateness);
+int metrics_export_start(int kind, const char *path, unsigned long interval);
+bool metrics_export_stop(void);
+
+#endif
+
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2016, Mark Jones <markalanj@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * The names of its contributors may not be used to endorse or promote
+ * products derived from this software without specific prior written
+ * permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <erl_driver.h>
+#include <ei.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "logger.h"
+#include "metrics.h"
+#include "native.h"
+#include "timerfd_abi.h"
+
+#define MAX_SUBSCRIBERS 64
+
+typedef struct
+{
+    int handle;             /* 0 when the slot is free */
+    unsigned long timer_id;
+    timerfd_tick_fn fn;
+    void *arg;
+    int efd;
+    timerfd_subscriber_stats stats;
+} subscriber;
+
+/* Ticks take the lock for reading, so timers served by different schedulers
+ * notify their subscribers in parallel */
+static ErlDrvRWLock *lock;
+static subscriber subscribers[MAX_SUBSCRIBERS];
+static int next_handle;
+
+void native_init(void)
+{
+    lock = erl_drv_rwlock_create("timerfd_native");
+    memset(subscribers, 0, sizeof(subscribers));
+    next_handle = 1;
+}
+
+void native_finish(void)
+{
+    erl_drv_rwlock_destroy(lock);
+}
+
+static int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void call_subscriber(subscriber *s, uint64_t expirations,
+                            int64_t deadline)
+{
+    int64_t start = monotonic_ns();
+    uint64_t elapsed;
+
+    if(s->fn)
+        s->fn(s->arg, expirations, deadline);
+    else if(write(s->efd, &expirations, sizeof(expirations)) < 0)
+        LOGGER_PRINT("eventfd write failed");
+
+    elapsed = monotonic_ns() - start;
+    METRIC_ADD(s->stats.calls, 1);
+    METRIC_ADD(s->stats.total_ns, elapsed);
+    if(elapsed > METRIC_GET(s->stats.max_ns))
+        METRIC_SET(s->stats.max_ns, elapsed);
+}
+
+void native_notify(unsigned long timer_id, uint64_t expirations,
+                   int64_t deadline)
+{
+    int i;
+
+    erl_drv_rwlock_rlock(lock);
+    for(i = 0; i < MAX_SUBSCRIBERS; i++)
+        if(subscribers[i].handle && subscribers[i].timer_id == timer_id)
+            call_subscriber(&subscribers[i], expirations, deadline);
+    erl_drv_rwlock_runlock(lock);
+}
+
+void native_timer_closed(unsigned long timer_id)
+{
+    int i;
+
+    erl_drv_rwlock_rwlock(lock);
+    for(i = 0; i < MAX_SUBSCRIBERS; i++)
+    {
+        if(subscribers[i].handle && subscribers[i].timer_id == timer_id)
+        {
+            if(subscribers[i].fn)
+                subscribers[i].fn(subscribers[i].arg, 0, 0);
+            subscribers[i].handle = 0;
+        }
+    }
+    erl_drv_rwlock_rwunlock(lock);
+}
+
+void native_encode_stats(unsigned long timer_id, ei_x_buff *x)
+{
+    subscriber *s;
+    int i;
+
+    erl_drv_rwlock_rlock(lock);
+    for(i = 0; i < MAX_SUBSCRIBERS; i++)
+    {
+        s = &subscribers[i];
+        if(!s->handle || s->timer_id != timer_id)
+            continue;
+        ei_x_encode_list_header(x, 1);
+        ei_x_encode_tuple_header(x, 4);
+        ei_x_encode_long(x, s->handle);
+        ei_x_encode_ulonglong(x, METRIC_GET(s->stats.calls));
+        ei_x_encode_ulonglong(x, METRIC_GET(s->stats.total_ns));
+        ei_x_encode_ulonglong(x, METRIC_GET(s->stats.max_ns));
+    }
+    erl_drv_rwlock_runlock(lock);
+    ei_x_encode_empty_list(x);
+}
+
+static int add_subscriber(unsigned long timer_id, timerfd_tick_fn fn,
+                          void *arg, int efd)
+{
+    int i, handle;
+
+    erl_drv_rwlock_rwlock(lock);
+    for(i = 0; i < MAX_SUBSCRIBERS && subscribers[i].handle; i++)
+        ;
+
+    if(i == MAX_SUBSCRIBERS)
+        handle = -ENOSPC;
+    else if(metrics_add_subscriber(timer_id, 1) != 0)
+        handle = -ENOENT;
+    else
+    {
+        memset(&subscribers[i], 0, sizeof(subscriber));
+        handle = subscribers[i].handle = next_handle++;
+        subscribers[i].timer_id = timer_id;
+        subscribers[i].fn = fn;
+        subscribers[i].arg = arg;
+        subscribers[i].efd = efd;
+    }
+    erl_drv_rwlock_rwunlock(lock);
+
+    return handle;
+}
+
+static subscriber *find_subscriber(int handle)
+{
+    int i;
+
+    for(i = 0; i < MAX_SUBSCRIBERS; i++)
+        if(handle > 0 && subscribers[i].handle == handle)
+            return &subscribers[i];
+
+    return NULL;
+}
+
+static int abi_find(const char *name, unsigned long *timer_id)
+{
+    return metrics_find(name, timer_id) == 0 ? 0 : -ENOENT;
+}
+
+static int abi_subscribe(unsigned long timer_id, timerfd_tick_fn fn,
+                         void *arg)
+{
+    return fn ? add_subscriber(timer_id, fn, arg, -1) : -EINVAL;
+}
+
+static int abi_subscribe_eventfd(unsigned long timer_id, int efd)
+{
+    return efd >= 0 ? add_subscriber(timer_id, NULL, NULL, efd) : -EBADF;
+}
+
+static int abi_unsubscribe(int handle)
+{
+    subscriber *s;
+    int err = -ENOENT;
+
+    erl_drv_rwlock_rwlock(lock);
+    if((s = find_subscriber(handle)))
+    {
+        metrics_add_subscriber(s->timer_id, -1);
+        s->handle = 0;
+        err = 0;
+    }
+    erl_drv_rwlock_rwunlock(lock);
+
+    return err;
+}
+
+static int abi_stats(int handle, timerfd_subscriber_stats *stats)
+{
+    subscriber *s;
+    int err = -ENOENT;
+
+    erl_drv_rwlock_rlock(lock);
+    if((s = find_subscriber(handle)))
+    {
+        stats->calls = METRIC_GET(s->stats.calls);
+        stats->total_ns = METRIC_GET(s->stats.total_ns);
+        stats->max_ns = METRIC_GET(s->stats.max_ns);
+        err = 0;
+    }
+    erl_drv_rwlock_runlock(lock);
+
+    return err;
+}
+
+static const timerfd_abi abi_v1 =
+{
+    TIMERFD_ABI_VERSION,
+    sizeof(timerfd_abi),
+    abi_find,
+    abi_subscribe,
+    abi_subscribe_eventfd,
+    abi_unsubscribe,
+    abi_stats
+};
+
+const timerfd_abi *timerfd_get_abi(uint32_t version)
+{
+    return version == TIMERFD_ABI_VERSION ? &abi_v1 : NULL;
+}
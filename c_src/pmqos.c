@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2016, Mark Jones <markalanj@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * The names of its contributors may not be used to endorse or promote
+ * products derived from this software without specific prior written
+ * permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <erl_driver.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "logger.h"
+#include "pmqos.h"
+
+#define PMQOS_PATH "/dev/cpu_dma_latency"
+
+/* The kernel keeps the request for as long as the file stays open and drops
+ * it on close, so the fd is the hint */
+static ErlDrvMutex *lock;
+static pmqos_request *requests;
+static int fd;
+static int32_t target;
+
+void pmqos_init(void)
+{
+    lock = erl_drv_mutex_create("timerfd_pmqos");
+    requests = NULL;
+    fd = -1;
+    target = -1;
+}
+
+void pmqos_finish(void)
+{
+    if(fd >= 0)
+        close(fd);
+    erl_drv_mutex_destroy(lock);
+}
+
+static void unlink_request(pmqos_request *req)
+{
+    if(req->prev)
+        req->prev->next = req->next;
+    else
+        requests = req->next;
+    if(req->next)
+        req->next->prev = req->prev;
+    req->active = false;
+}
+
+static void close_hint(void)
+{
+    close(fd);
+    __atomic_store_n(&fd, -1, __ATOMIC_RELAXED);
+    target = -1;
+    LOGGER_PRINT("pm_qos released");
+}
+
+/* Write the lowest target of the linked requests, opening the file on first
+ * use. Returns 0 or errno. */
+static int apply(void)
+{
+    pmqos_request *req;
+    int32_t lowest = INT32_MAX;
+    int tmp;
+
+    for(req = requests; req; req = req->next)
+        if(req->target < lowest)
+            lowest = req->target;
+
+    if(fd < 0)
+    {
+        tmp = open(PMQOS_PATH, O_WRONLY | O_CLOEXEC);
+        if(tmp < 0)
+            return errno;
+        __atomic_store_n(&fd, tmp, __ATOMIC_RELAXED);
+    }
+
+    if(lowest != target)
+    {
+        if(write(fd, &lowest, sizeof(lowest)) != sizeof(lowest))
+        {
+            tmp = errno;
+            close_hint();
+            return tmp;
+        }
+        target = lowest;
+        LOGGER_PRINT("pm_qos target %d us", (int)lowest);
+    }
+
+    return 0;
+}
+
+/* Link a request in and update the hint. On failure the request is left
+ * out and errno returned, the timer carries on without the hint. */
+int pmqos_acquire(pmqos_request *req)
+{
+    int err;
+
+    erl_drv_mutex_lock(lock);
+    if(!req->active)
+    {
+        req->prev = NULL;
+        req->next = requests;
+        if(requests)
+            requests->prev = req;
+        requests = req;
+        req->active = true;
+    }
+
+    err = apply();
+    if(err != 0)
+    {
+        LOGGER_PRINT("pm_qos request failed, errno %d", err);
+        unlink_request(req);
+    }
+    erl_drv_mutex_unlock(lock);
+    return err;
+}
+
+void pmqos_release(pmqos_request *req)
+{
+    erl_drv_mutex_lock(lock);
+    if(req->active)
+    {
+        unlink_request(req);
+        if(!requests)
+        {
+            if(fd >= 0)
+                close_hint();
+        }
+        else if(apply() != 0)
+        {
+            LOGGER_PRINT("pm_qos update failed");
+        }
+    }
+    erl_drv_mutex_unlock(lock);
+}
+
+/* Whether the node holds the hint right now, read on every tick */
+bool pmqos_held(void)
+{
+    return __atomic_load_n(&fd, __ATOMIC_RELAXED) >= 0;
+}
+
+int32_t pmqos_target(void)
+{
+    int32_t value;
+
+    erl_drv_mutex_lock(lock);
+    value = target;
+    erl_drv_mutex_unlock(lock);
+    return value;
+}
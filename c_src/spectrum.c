@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2016, Mark Jones <markalanj@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * The names of its contributors may not be used to endorse or promote
+ * products derived from this software without specific prior written
+ * permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <erl_driver.h>
+#include <math.h>
+#include <string.h>
+#include "spectrum.h"
+
+#define TWO_PI          6.28318530717958647692
+/* Samples per Welch segment, which bounds both the memory used and the
+ * longest period that can be found */
+#define SEGMENT_LEN     4096
+
+/* Real and imaginary parts in separate arrays so the compiler can vectorize
+ * the butterflies of the later, wider stages */
+typedef struct
+{
+    double *re;
+    double *im;
+    size_t n;
+} signal;
+
+static void bit_reverse(signal *s)
+{
+    size_t i, j = 0, bit;
+    double t;
+
+    for(i = 1; i < s->n; i++)
+    {
+        for(bit = s->n >> 1; j & bit; bit >>= 1)
+            j ^= bit;
+        j |= bit;
+        if(i < j)
+        {
+            t = s->re[i]; s->re[i] = s->re[j]; s->re[j] = t;
+            t = s->im[i]; s->im[i] = s->im[j]; s->im[j] = t;
+        }
+    }
+}
+
+/* The twiddle factors of the full length transform, computed once and
+ * shared by every segment */
+static void init_twiddle(size_t n, double *twiddle)
+{
+    size_t k;
+
+    for(k = 0; k < n / 2; k++)
+    {
+        twiddle[k] = cos(TWO_PI * k / n);
+        twiddle[n / 2 + k] = -sin(TWO_PI * k / n);
+    }
+}
+
+/* In place iterative radix-2 FFT. The
+ * twiddle factors of each stage are gathered into contiguous arrays first so
+ * the inner loop runs over consecutive elements and vectorizes. */
+static void fft(signal *s, double *twiddle)
+{
+    double *restrict re = s->re;
+    double *restrict im = s->im;
+    double *restrict wr = twiddle;
+    double *restrict wi = twiddle + s->n / 2;
+    double *restrict tr = twiddle + s->n;
+    double *restrict ti = twiddle + s->n + s->n / 2;
+    double ur, ui, vr, vi;
+    size_t len, half, step, j, k;
+
+    bit_reverse(s);
+    for(len = 2; len <= s->n; len <<= 1)
+    {
+        half = len >> 1;
+        step = s->n / len;
+        for(k = 0; k < half; k++)
+        {
+            tr[k] = wr[k * step];
+            ti[k] = wi[k * step];
+        }
+
+        for(j = 0; j < s->n; j += len)
+        {
+            for(k = 0; k < half; k++)
+            {
+                ur = re[j + k];
+                ui = im[j + k];
+                vr = re[j + k + half] * tr[k] - im[j + k + half] * ti[k];
+                vi = re[j + k + half] * ti[k] + im[j + k + half] * tr[k];
+                re[j + k] = ur + vr;
+                im[j + k] = ui + vi;
+                re[j + k + half] = ur - vr;
+                im[j + k + half] = ui - vi;
+            }
+        }
+    }
+}
+
+static void insert_peak(spectrum_peak *peaks, double *power, size_t *count,
+                        size_t max_peaks, spectrum_peak *peak, double p)
+{
+    size_t i = *count < max_peaks ? (*count)++ : max_peaks;
+
+    /* Keep peaks sorted by power, dropping the weakest */
+    for(; i > 0 && power[i - 1] < p; i--)
+    {
+        if(i < max_peaks)
+        {
+            peaks[i] = peaks[i - 1];
+            power[i] = power[i - 1];
+        }
+    }
+    if(i < max_peaks)
+    {
+        peaks[i] = *peak;
+        power[i] = p;
+    }
+}
+
+/* Add the power spectrum of one Hann windowed, mean removed segment */
+static void add_segment(signal *s, double *twiddle, const double *samples,
+                        size_t len, double *spectrum)
+{
+    double mean = 0.0, w;
+    size_t i;
+
+    memset(s->re, 0, 2 * s->n * sizeof(double));
+    for(i = 0; i < len; i++)
+        mean += samples[i];
+    mean /= len;
+
+    for(i = 0; i < len; i++)
+    {
+        w = 0.5 - 0.5 * cos(TWO_PI * i / (len - 1));
+        s->re[i] = (samples[i] - mean) * w;
+    }
+
+    fft(s, twiddle);
+    for(i = 0; i <= s->n / 2; i++)
+        spectrum[i] += s->re[i] * s->re[i] + s->im[i] * s->im[i];
+}
+
+/* Find the strongest periodic components of samples taken at a regular
+ * interval. Long series are cut into half overlapping segments of
+ * SEGMENT_LEN samples whose power spectra are averaged (Welch's method), so
+ * memory stays bounded and noise averages out. Each segment has its mean
+ * removed and a Hann window applied, and is zero padded to at least twice
+ * its length. A component counts if it is the largest within the main lobe
+ * of the window, so leakage is not reported as separate peaks. Returns the
+ * number of peaks found or -1 when out of memory. */
+int spectrum_peaks(const double *samples, size_t n, spectrum_peak *peaks,
+                   size_t max_peaks)
+{
+    double power[max_peaks > 0 ? max_peaks : 1];
+    double total = 0.0, lobe, w, p, a, c, delta;
+    spectrum_peak peak;
+    size_t count = 0, segments = 0, len, half_lobe, start, i, j;
+    double *twiddle, *spectrum;
+    signal s;
+
+    if(n < 4 || max_peaks == 0)
+        return 0;
+
+    len = n < SEGMENT_LEN ? n : SEGMENT_LEN;
+    for(s.n = 1; s.n < 2 * len; s.n <<= 1)
+        ;
+    /* Signal, twiddle factor space and the averaged spectrum */
+    if(!(s.re = driver_alloc((4 * s.n + s.n / 2 + 1) * sizeof(double))))
+        return -1;
+    s.im = s.re + s.n;
+    twiddle = s.im + s.n;
+    spectrum = twiddle + 2 * s.n;
+    memset(spectrum, 0, (s.n / 2 + 1) * sizeof(double));
+    init_twiddle(s.n, twiddle);
+
+    for(start = 0; start + len <= n; start += len / 2)
+    {
+        add_segment(&s, twiddle, samples + start, len, spectrum);
+        segments++;
+    }
+    /* Cover the tail with a last segment aligned to the end */
+    if(start + len / 2 < n)
+    {
+        add_segment(&s, twiddle, samples + n - len, len, spectrum);
+        segments++;
+    }
+
+    for(i = 0; i <= s.n / 2; i++)
+    {
+        spectrum[i] /= segments;
+        if(i > 0)
+            total += spectrum[i];
+    }
+
+    /* The Hann main lobe is two bins either side, times the padding */
+    half_lobe = 2 * s.n / len + 1;
+    for(i = 1; i < s.n / 2; i++)
+    {
+        p = spectrum[i];
+        lobe = 0.0;
+        for(j = i > half_lobe ? i - half_lobe : 1;
+            j <= i + half_lobe && j <= s.n / 2; j++)
+        {
+            if(spectrum[j] > p || (spectrum[j] == p && j < i))
+                break;
+            lobe += spectrum[j];
+        }
+        if(j <= i + half_lobe && j <= s.n / 2)
+            continue;
+
+        /* Parabolic interpolation between bins */
+        a = sqrt(spectrum[i - 1]);
+        c = sqrt(spectrum[i + 1]);
+        w = a - 2.0 * sqrt(p) + c;
+        delta = w < 0.0 ? 0.5 * (a - c) / w : 0.0;
+
+        peak.period = s.n / (i + delta);
+        /* Hann coherent gain is 0.5 */
+        peak.amplitude = 4.0 * sqrt(p) / len;
+        peak.share = total > 0.0 ? lobe / total : 0.0;
+        insert_peak(peaks, power, &count, max_peaks, &peak, p);
+    }
+
+    driver_free(s.re);
+    return (int)count;
+}
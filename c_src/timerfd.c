@@ -30,16 +30,26 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <erl_driver.h>
 #include <ei.h>
-#include <linux/time.h>
+#include <time.h>
 #include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include "logger.h"
 #include "ei_x_extras.h"
+#include "metrics.h"
+#include "inject.h"
+#include "spectrum.h"
+#include "native.h"
+#include "pmqos.h"
+#include "timerfd_abi.h"
 
 #define MODULE          "timerfd"
 #define LOGFILE         "timerfd.log"
@@ -52,14 +62,69 @@
 #define ATOM_EWOULDBLOCK        "ewouldblock"
 #define ATOM_CLOCK_MONOTONIC    "clock_monotonic"
 #define ATOM_CLOCK_REALTIME     "clock_realtime"
+#define ATOM_UNDEFINED          "undefined"
+#define ATOM_PRIORITY           "priority"
+#define ATOM_NAME               "name"
+#define ATOM_LATENESS_SLO       "lateness_slo"
+#define ATOM_FILE               "file"
+#define ATOM_UNIX               "unix"
+#define ATOM_STOP               "stop"
+#define ATOM_OFF                "off"
+#define ATOM_INJECT             "inject"
+#define ATOM_SEED               "seed"
+#define ATOM_DROP               "drop"
+#define ATOM_DELAY              "delay"
+#define ATOM_UNIFORM            "uniform"
+#define ATOM_LOGNORMAL          "lognormal"
+#define ATOM_STALL              "stall"
+#define ATOM_BURST              "burst"
+#define ATOM_PM_QOS             "pm_qos"
+#define ATOM_SUBSCRIBE          "subscribe"
+#define ATOM_DRAIN              "drain"
+
+#define MAX_PEAKS               32
 
 #define EVENT2FD(x) (long)(x)
 #define FD2EVENT(x) (ErlDrvEvent)(long)(x)
 
+/* Asynchronous settime requests arrive as fixed size records through the
+ * port command path: interval sec, interval nsec, value sec, value nsec as
+ * big endian 64 bit integers followed by a one byte absolute flag. */
+#define ASYNC_RECORD_SIZE       33
+#define ASYNC_QUEUE_SIZE        64
+
+typedef struct
+{
+    struct itimerspec value;
+    int flags;
+} settime_request;
+
 typedef struct
 {
     ErlDrvPort port;
     int fd;
+    int clockid;
+    int64_t deadline;       /* first expiration in ns, 0 when disarmed */
+    int64_t interval;       /* ns */
+    bool prioritized;
+    long priority;
+    uint64_t pending;       /* expirations read by the driver itself */
+    int64_t *schedule;      /* intervals in ns between replayed expirations */
+    size_t schedule_len;
+    size_t schedule_pos;
+    bool schedule_loop;
+    injector *inject;       /* NULL unless injecting faults */
+    bool notified;          /* a ready message awaits a read */
+    pmqos_request qos;
+    int qos_errno;          /* last failure to take the hint */
+    /* Lateness while the node held the hint and while it did not */
+    uint64_t qos_ticks[2];
+    int64_t qos_lateness[2];    /* ns */
+    int probe_efd;          /* eventfd subscribed by the probe command */
+    int probe_handle;
+    settime_request queue[ASYNC_QUEUE_SIZE];
+    unsigned int queue_len;
+    timer_metrics metrics;
 } timer_data;
 
 enum
@@ -67,9 +132,20 @@ enum
     CREATE  = 0,
     SETTIME = 1,
     GETTIME = 2,
-    READ = 3
+    READ = 3,
+    STATS = 4,
+    SETOPTS = 5,
+    EXPORT = 6,
+    SCHEDULE = 7,
+    ANALYZE = 8,
+    SUBSCRIBERS = 9,
+    CLOCK = 10,
+    PROBE = 11
 };
 
+static ErlDrvTermData am_timerfd;
+static ErlDrvTermData am_ready;
+
 static ErlDrvSSizeT encode_error(ei_x_buff *x, const char *str)
 {
     ei_x_encode_tuple_header(x, 2);
@@ -84,6 +160,141 @@ static ErlDrvSSizeT encode_ok(ei_x_buff *x)
     return x->index;
 }
 
+static ErlDrvSSizeT encode_stat(ei_x_buff *x, const char *name,
+                                unsigned long value)
+{
+    ei_x_encode_list_header(x, 1);
+    ei_x_encode_tuple_header(x, 2);
+    ei_x_encode_atom(x, name);
+    ei_x_encode_ulong(x, value);
+    return x->index;
+}
+
+static int64_t get_int64(const unsigned char *p)
+{
+    uint64_t n = 0;
+    int i;
+
+    for(i = 0; i < 8; i++)
+        n = (n << 8) | p[i];
+
+    return (int64_t)n;
+}
+
+static int64_t timespec_to_ns(const struct timespec *ts)
+{
+    return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static int64_t clock_now(timer_data *data)
+{
+    struct timespec ts;
+
+    clock_gettime(data->clockid, &ts);
+    return timespec_to_ns(&ts);
+}
+
+/* Hold the PM QoS hint while a timer that asked for it is armed */
+static void update_pmqos(timer_data *data)
+{
+    bool wanted = data->qos.target >= 0 && data->deadline != 0;
+    int err;
+
+    if(wanted == data->qos.active)
+        return;
+
+    /* After a failure the timer stays without the hint until the option is
+     * set again, rather than trying the device on every arm */
+    if(!wanted)
+        pmqos_release(&data->qos);
+    else if(data->qos_errno == 0 && (err = pmqos_acquire(&data->qos)) != 0)
+        data->qos_errno = err;
+}
+
+/* Arm the timer and remember its schedule so the deadline of each expiration
+ * can be worked out when it fires. */
+static int arm_timer(timer_data *data, int flags,
+                     const struct itimerspec *new_value,
+                     struct itimerspec *old_value)
+{
+    int64_t value = timespec_to_ns(&new_value->it_value);
+    int64_t now = clock_now(data);
+
+    if(timerfd_settime(data->fd, flags, new_value, old_value) != 0)
+        return -1;
+
+    if(value == 0)
+        data->deadline = 0;
+    else if(flags & TFD_TIMER_ABSTIME)
+        data->deadline = value;
+    else
+        data->deadline = now + value;
+
+    data->interval = timespec_to_ns(&new_value->it_interval);
+    update_pmqos(data);
+    return 0;
+}
+
+/* Deadline of the most recent expiration at or before now */
+static int64_t last_deadline(timer_data *data, int64_t now)
+{
+    int64_t deadline = data->deadline;
+
+    if(data->interval > 0 && now > deadline)
+        deadline += (now - deadline) / data->interval * data->interval;
+
+    return deadline;
+}
+
+static void cancel_schedule(timer_data *data)
+{
+    if(data->schedule)
+    {
+        driver_free(data->schedule);
+        data->schedule = NULL;
+    }
+}
+
+/* Arm the next expiration of the schedule as an absolute deadline so replay
+ * does not drift when wakeups are late. Returns false when the schedule is
+ * done. */
+static bool arm_schedule(timer_data *data, int64_t deadline)
+{
+    struct itimerspec value;
+
+    if(data->schedule_pos == data->schedule_len)
+    {
+        if(!data->schedule_loop)
+            return false;
+        data->schedule_pos = 0;
+    }
+
+    deadline += data->schedule[data->schedule_pos++];
+    memset(&value, 0, sizeof(value));
+    value.it_value.tv_sec = deadline / 1000000000;
+    value.it_value.tv_nsec = deadline % 1000000000;
+    return arm_timer(data, TFD_TIMER_ABSTIME, &value, NULL) == 0;
+}
+
+/* The driver reads the expirations of a replayed timer itself, because
+ * rearming clears them, and hands them to the next read() */
+static void advance_schedule(timer_data *data)
+{
+    struct itimerspec disarm;
+    uint64_t expirations;
+
+    if(read(data->fd, &expirations, sizeof(expirations)) > 0)
+        data->pending += expirations;
+
+    if(!arm_schedule(data, data->deadline))
+    {
+        LOGGER_PRINT("schedule done");
+        cancel_schedule(data);
+        memset(&disarm, 0, sizeof(disarm));
+        arm_timer(data, 0, &disarm, NULL);
+    }
+}
+
 static ErlDrvSSizeT create_timer(timer_data *data, ei_x_buff *in_x_buff,
                                  ei_x_buff *out_x_buff)
 {
@@ -99,6 +310,7 @@ static ErlDrvSSizeT create_timer(timer_data *data, ei_x_buff *in_x_buff,
 
         if(clockid != -1)
         {
+            data->clockid = clockid;
             data->fd = timerfd_create(clockid, TFD_NONBLOCK | TFD_CLOEXEC);
             if(data->fd < 0)
             {
@@ -108,6 +320,7 @@ static ErlDrvSSizeT create_timer(timer_data *data, ei_x_buff *in_x_buff,
             else
             {
                 LOGGER_PRINT("timerfd_create() success");
+                metrics_register(&data->metrics);
                 driver_select(data->port, FD2EVENT(data->fd),
                               ERL_DRV_READ | ERL_DRV_USE, 1);
                 encode_ok(out_x_buff);
@@ -143,7 +356,15 @@ static ErlDrvSSizeT settime(timer_data *data, ei_x_buff *in_x_buff,
     if(strcmp(atom, ATOM_TRUE) == 0)
         flags = TFD_TIMER_ABSTIME;
 
-    if(timerfd_settime(data->fd, flags, &new_value, &old_value) == 0)
+    /* A synchronous request supersedes anything still queued */
+    if(data->queue_len > 0)
+    {
+        data->queue_len = 0;
+        driver_cancel_timer(data->port);
+    }
+    cancel_schedule(data);
+
+    if(arm_timer(data, flags, &new_value, &old_value) == 0)
     {
         LOGGER_PRINT("timerfd_settime sucessful");
         ei_x_format_wo_ver(out_x_buff, "{~a,{{~i,~i},{~i,~i}}}",
@@ -176,23 +397,35 @@ static ErlDrvSSizeT gettime(timer_data *data, ei_x_buff *in_x_buff,
 static ErlDrvSSizeT read_timer(timer_data *data, ei_x_buff *in_x_buff,
                                ei_x_buff *out_x_buff)
 {
-    uint64_t expirations;
+    uint64_t expirations = 0;
+    int err = 0;
+
+    /* A replayed timer is only read by ready_input, which rearms it. An
+     * expiration consumed here would leave the schedule stuck. */
+    if(data->schedule)
+        err = EAGAIN;
+    else if(read(data->fd, &expirations, sizeof(expirations)) < 0)
+        err = errno;
 
-    if(read(data->fd, &expirations, sizeof(expirations)) < 0)
+    if(err != 0 && !(err == EAGAIN && data->pending > 0))
     {
-        switch(errno)
+        switch(err)
         {
         case EAGAIN:
             ei_x_format_wo_ver(out_x_buff, "{~a,~a}", ATOM_ERROR,
                                ATOM_EWOULDBLOCK);
             break;
         default:
-            ei_x_format_wo_ver(out_x_buff, "{~a,~i}", ATOM_ERROR, errno);
+            ei_x_format_wo_ver(out_x_buff, "{~a,~i}", ATOM_ERROR, err);
             break;
         }
     }
     else
     {
+        expirations += data->pending;
+        data->pending = 0;
+        data->notified = false;
+        METRIC_ADD(data->metrics.expirations, expirations);
         ei_x_format_wo_ver(out_x_buff, "{~a,~i}", ATOM_OK, expirations);
     }
 
@@ -201,15 +434,712 @@ static ErlDrvSSizeT read_timer(timer_data *data, ei_x_buff *in_x_buff,
     return out_x_buff->index;
 }
 
+static int64_t mean_lateness(timer_data *data, int held)
+{
+    if(data->qos_ticks[held] == 0)
+        return 0;
+    return data->qos_lateness[held] / (int64_t)data->qos_ticks[held];
+}
+
+static ErlDrvSSizeT stats(timer_data *data, ei_x_buff *in_x_buff,
+                          ei_x_buff *out_x_buff)
+{
+    timer_metrics *m = &data->metrics;
+
+    ei_x_encode_tuple_header(out_x_buff, 2);
+    ei_x_encode_atom(out_x_buff, ATOM_OK);
+    encode_stat(out_x_buff, "id", m->id);
+    encode_stat(out_x_buff, "ticks", m->ticks);
+    encode_stat(out_x_buff, "expirations", m->expirations);
+    encode_stat(out_x_buff, "lateness_max", m->lateness_max / 1000);
+    encode_stat(out_x_buff, "lateness_slo_violations", m->slo_violations);
+    ei_x_encode_list_header(out_x_buff, 1);
+    ei_x_encode_tuple_header(out_x_buff, 2);
+    ei_x_encode_atom(out_x_buff, "pm_qos_active");
+    ei_x_encode_atom(out_x_buff, data->qos.active ? ATOM_TRUE : ATOM_FALSE);
+    encode_stat(out_x_buff, "pm_qos_target",
+                data->qos.active ? pmqos_target() : 0);
+    encode_stat(out_x_buff, "pm_qos_errno", data->qos_errno);
+    encode_stat(out_x_buff, "lateness_mean_pm_qos",
+                mean_lateness(data, 1) / 1000);
+    encode_stat(out_x_buff, "lateness_mean_no_pm_qos",
+                mean_lateness(data, 0) / 1000);
+    encode_stat(out_x_buff, "native_subscribers", m->subscribers);
+    encode_stat(out_x_buff, "async_requests", m->async_requests);
+    encode_stat(out_x_buff, "async_batches", m->async_batches);
+    encode_stat(out_x_buff, "async_max_batch", m->async_max_batch);
+    encode_stat(out_x_buff, "async_queue_full", m->async_queue_full);
+    encode_stat(out_x_buff, "async_errors", m->async_errors);
+    encode_stat(out_x_buff, "inject_drops",
+                data->inject ? data->inject->drops : 0);
+    encode_stat(out_x_buff, "inject_delays",
+                data->inject ? data->inject->delays : 0);
+    encode_stat(out_x_buff, "inject_bursts",
+                data->inject ? data->inject->bursts : 0);
+    ei_x_encode_empty_list(out_x_buff);
+    return out_x_buff->index;
+}
+
+static ErlDrvSSizeT set_schedule(timer_data *data, ei_x_buff *in_x_buff,
+                                 ei_x_buff *out_x_buff)
+{
+    char atom[MAXATOMLEN];
+    int arity = 0, type, size;
+    int64_t *schedule;
+    long len;
+    size_t i;
+
+    if(ei_x_decode_tuple_header(in_x_buff, &arity) != 0 || arity != 2
+       || ei_x_get_type(in_x_buff, &type, &size) != 0
+       || type != ERL_BINARY_EXT || size == 0 || size % 8 != 0)
+        return -1; /* badarg */
+
+    if(!(schedule = driver_alloc(size)))
+    {
+        encode_error(out_x_buff, "enomem");
+        return out_x_buff->index;
+    }
+
+    if(ei_x_decode_binary(in_x_buff, schedule, &len) != 0
+       || ei_x_decode_atom(in_x_buff, atom) != 0)
+    {
+        driver_free(schedule);
+        return -1; /* badarg */
+    }
+
+    for(i = 0; i < size / 8; i++)
+        schedule[i] = get_int64((const unsigned char *)&schedule[i]);
+
+    data->queue_len = 0;
+    cancel_schedule(data);
+    data->schedule = schedule;
+    data->schedule_len = size / 8;
+    data->schedule_pos = 0;
+    data->schedule_loop = strcmp(atom, ATOM_TRUE) == 0;
+
+    if(arm_schedule(data, clock_now(data)))
+        encode_ok(out_x_buff);
+    else
+    {
+        cancel_schedule(data);
+        encode_error(out_x_buff, "timerfd_settime failed");
+    }
+
+    return out_x_buff->index;
+}
+
+/* Spectral analysis runs on an async thread, long captures would otherwise
+ * hold a scheduler */
+typedef struct
+{
+    double *samples;
+    size_t n;
+    size_t max_peaks;
+    int count;
+    spectrum_peak peaks[MAX_PEAKS];
+} analyze_job;
+
+static void analyze_work(void *arg)
+{
+    analyze_job *job = (analyze_job *)arg;
+
+    job->count = spectrum_peaks(job->samples, job->n, job->peaks,
+                                job->max_peaks);
+    driver_free(job->samples);
+    job->samples = NULL;
+}
+
+static void analyze_free(void *arg)
+{
+    analyze_job *job = (analyze_job *)arg;
+
+    if(job->samples)
+        driver_free(job->samples);
+    driver_free(job);
+}
+
+static ErlDrvSSizeT analyze(timer_data *data, ei_x_buff *in_x_buff,
+                            ei_x_buff *out_x_buff)
+{
+    analyze_job *job;
+    int arity = 0, type, size;
+    long len, max_peaks;
+
+    if(ei_x_decode_tuple_header(in_x_buff, &arity) != 0 || arity != 2
+       || ei_x_get_type(in_x_buff, &type, &size) != 0
+       || type != ERL_BINARY_EXT || size % sizeof(double) != 0)
+        return -1; /* badarg */
+
+    if(!(job = driver_alloc(sizeof(analyze_job))))
+    {
+        encode_error(out_x_buff, "enomem");
+        return out_x_buff->index;
+    }
+
+    if(!(job->samples = driver_alloc(size > 0 ? size : 1)))
+    {
+        driver_free(job);
+        encode_error(out_x_buff, "enomem");
+        return out_x_buff->index;
+    }
+
+    if(ei_x_decode_binary(in_x_buff, job->samples, &len) != 0
+       || ei_x_decode_long(in_x_buff, &max_peaks) != 0 || max_peaks < 0)
+    {
+        analyze_free(job);
+        return -1; /* badarg */
+    }
+
+    job->n = size / sizeof(double);
+    job->max_peaks = max_peaks > MAX_PEAKS ? MAX_PEAKS : max_peaks;
+    driver_async(data->port, NULL, analyze_work, job, analyze_free);
+    encode_ok(out_x_buff);
+    return out_x_buff->index;
+}
+
+/* Send the result of an analysis to the port owner */
+static void ready_async(ErlDrvData handle, ErlDrvThreadData thread_data)
+{
+    timer_data *data = (timer_data *)handle;
+    analyze_job *job = (analyze_job *)thread_data;
+    ei_x_buff x;
+    int i;
+
+    if(ei_x_new_with_version(&x) != 0)
+    {
+        analyze_free(job);
+        return;
+    }
+
+    if(job->count < 0)
+    {
+        encode_error(&x, "enomem");
+    }
+    else
+    {
+        ei_x_encode_tuple_header(&x, 2);
+        ei_x_encode_atom(&x, ATOM_OK);
+        if(job->count > 0)
+            ei_x_encode_list_header(&x, job->count);
+        for(i = 0; i < job->count; i++)
+        {
+            ei_x_encode_tuple_header(&x, 3);
+            ei_x_encode_double(&x, job->peaks[i].period);
+            ei_x_encode_double(&x, job->peaks[i].amplitude);
+            ei_x_encode_double(&x, job->peaks[i].share);
+        }
+        ei_x_encode_empty_list(&x);
+    }
+
+    driver_output(data->port, x.buff, x.index);
+    ei_x_free(&x);
+    analyze_free(job);
+}
+
+static ErlDrvSSizeT subscribers(timer_data *data, ei_x_buff *in_x_buff,
+                                ei_x_buff *out_x_buff)
+{
+    ei_x_encode_tuple_header(out_x_buff, 2);
+    ei_x_encode_atom(out_x_buff, ATOM_OK);
+    native_encode_stats(data->metrics.id, out_x_buff);
+    return out_x_buff->index;
+}
+
+/* Subscribes an eventfd to a named timer through the native ABI, the way
+ * other native code would, behind timerfd:probe/1 and drain_probe/1.
+ * {subscribe, Name} returns the handle, drain the expirations signalled
+ * since the last drain. */
+static ErlDrvSSizeT probe(timer_data *data, ei_x_buff *in_x_buff,
+                          ei_x_buff *out_x_buff)
+{
+    const timerfd_abi *abi = timerfd_get_abi(TIMERFD_ABI_VERSION);
+    char atom[MAXATOMLEN];
+    unsigned long timer_id;
+    uint64_t count = 0;
+    int arity = 0, type, size, handle;
+
+    ei_x_get_type(in_x_buff, &type, &size);
+    if(type == ERL_ATOM_EXT)
+    {
+        if(ei_x_decode_atom(in_x_buff, atom) != 0
+           || strcmp(atom, ATOM_DRAIN) != 0 || data->probe_efd < 0)
+            return -1; /* badarg */
+        if(read(data->probe_efd, &count, sizeof(count)) < 0
+           && errno != EAGAIN)
+            return encode_error(out_x_buff, strerror(errno));
+        ei_x_encode_tuple_header(out_x_buff, 2);
+        ei_x_encode_atom(out_x_buff, ATOM_OK);
+        ei_x_encode_ulonglong(out_x_buff, count);
+        return out_x_buff->index;
+    }
+
+    if(ei_x_decode_tuple_header(in_x_buff, &arity) != 0 || arity != 2
+       || ei_x_decode_atom(in_x_buff, atom) != 0
+       || strcmp(atom, ATOM_SUBSCRIBE) != 0
+       || ei_x_decode_atom(in_x_buff, atom) != 0 || data->probe_efd >= 0)
+        return -1; /* badarg */
+
+    if(abi->find(atom, &timer_id) != 0)
+        return encode_error(out_x_buff, "not found");
+
+    data->probe_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(data->probe_efd < 0)
+        return encode_error(out_x_buff, strerror(errno));
+
+    if((handle = abi->subscribe_eventfd(timer_id, data->probe_efd)) < 0)
+    {
+        close(data->probe_efd);
+        data->probe_efd = -1;
+        return encode_error(out_x_buff, strerror(-handle));
+    }
+
+    data->probe_handle = handle;
+    ei_x_encode_tuple_header(out_x_buff, 2);
+    ei_x_encode_atom(out_x_buff, ATOM_OK);
+    ei_x_encode_long(out_x_buff, handle);
+    return out_x_buff->index;
+}
+
+static ErlDrvSSizeT clock_time(timer_data *data, ei_x_buff *in_x_buff,
+                               ei_x_buff *out_x_buff)
+{
+    ei_x_encode_tuple_header(out_x_buff, 2);
+    ei_x_encode_atom(out_x_buff, ATOM_OK);
+    ei_x_encode_longlong(out_x_buff, clock_now(data));
+    return out_x_buff->index;
+}
+
+static ErlDrvSSizeT export_metrics(timer_data *data, ei_x_buff *in_x_buff,
+                                   ei_x_buff *out_x_buff)
+{
+    char atom[MAXATOMLEN];
+    char path[MAXATOMLEN];
+    int arity = 0, type, size, kind, err;
+    long interval = 0, len;
+
+    if(ei_x_get_type(in_x_buff, &type, &size) != 0)
+        return -1; /* badarg */
+
+    if(type == ERL_ATOM_EXT)
+    {
+        if(ei_x_decode_atom(in_x_buff, atom) != 0
+           || strcmp(atom, ATOM_STOP) != 0)
+            return -1; /* badarg */
+        if(metrics_export_stop())
+            encode_ok(out_x_buff);
+        else
+            encode_error(out_x_buff, "not running");
+        return out_x_buff->index;
+    }
+
+    if(ei_x_decode_tuple_header(in_x_buff, &arity) != 0
+       || ei_x_decode_atom(in_x_buff, atom) != 0)
+        return -1; /* badarg */
+
+    if(strcmp(atom, ATOM_FILE) == 0 && arity == 3)
+        kind = EXPORT_FILE;
+    else if(strcmp(atom, ATOM_UNIX) == 0 && arity == 2)
+        kind = EXPORT_UNIX;
+    else
+        return -1; /* badarg */
+
+    if(ei_x_get_type(in_x_buff, &type, &size) != 0
+       || type != ERL_BINARY_EXT || size >= sizeof(path)
+       || ei_x_decode_binary(in_x_buff, path, &len) != 0)
+        return -1; /* badarg */
+    path[len] = '\0';
+
+    if(kind == EXPORT_FILE
+       && (ei_x_decode_long(in_x_buff, &interval) != 0 || interval <= 0))
+        return -1; /* badarg */
+
+    if((err = metrics_export_start(kind, path, interval)) != 0)
+        encode_error(out_x_buff, strerror(err));
+    else
+        encode_ok(out_x_buff);
+
+    return out_x_buff->index;
+}
+
+/* Timers with a priority skip the binary encoding and send
+ * {Port, {timerfd, ready, Priority, Deadline}} so that receivers can pick
+ * them out of the mailbox and order them. */
+static void output_prioritized(timer_data *data, ErlDrvSInt64 deadline)
+{
+    ErlDrvTermData port = driver_mk_port(data->port);
+    ErlDrvTermData spec[] =
+    {
+        ERL_DRV_PORT, port,
+        ERL_DRV_ATOM, am_timerfd,
+        ERL_DRV_ATOM, am_ready,
+        ERL_DRV_INT, (ErlDrvTermData)data->priority,
+        ERL_DRV_INT64, (ErlDrvTermData)&deadline,
+        ERL_DRV_TUPLE, 4,
+        ERL_DRV_TUPLE, 2
+    };
+
+    erl_drv_output_term(port, spec, sizeof(spec) / sizeof(spec[0]));
+}
+
+static void output_ready(timer_data *data, int64_t deadline)
+{
+    ei_x_buff x;
+
+    if(data->prioritized)
+        output_prioritized(data, deadline);
+    else
+    {
+        ei_x_new_with_version(&x);
+        ei_x_encode_tuple_header(&x, 2);
+        ei_x_encode_atom(&x, "timerfd");
+        ei_x_encode_atom(&x, "ready");
+        driver_output(data->port, x.buff, x.index);
+        ei_x_free(&x);
+    }
+}
+
+/* Returns true when the tick is to be delivered right away */
+static bool inject_fault(timer_data *data, int64_t now, int64_t deadline)
+{
+    injector *inj = data->inject;
+    struct itimerspec value;
+    inject_action action;
+    uint64_t expirations;
+
+    inject_tick(inj, now, &action);
+
+    if(action.drop)
+    {
+        if(read(data->fd, &expirations, sizeof(expirations)) < 0)
+            LOGGER_PRINT("dropped tick already read");
+        data->pending = 0;
+        data->notified = false;
+        driver_select(data->port, FD2EVENT(data->fd),
+                      ERL_DRV_READ | ERL_DRV_USE, 1);
+        return false;
+    }
+
+    data->pending += action.extra;
+
+    if(action.delay > 0 && inj->delay_fd >= 0)
+    {
+        memset(&value, 0, sizeof(value));
+        value.it_value.tv_sec = action.delay / 1000000000;
+        value.it_value.tv_nsec = action.delay % 1000000000;
+        if(timerfd_settime(inj->delay_fd, 0, &value, NULL) == 0)
+        {
+            inj->delaying = true;
+            inj->delayed_deadline = deadline;
+            driver_select(data->port, FD2EVENT(inj->delay_fd),
+                          ERL_DRV_READ | ERL_DRV_USE, 1);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void deliver_delayed(timer_data *data)
+{
+    injector *inj = data->inject;
+    uint64_t expirations;
+
+    if(read(inj->delay_fd, &expirations, sizeof(expirations)) < 0)
+        LOGGER_PRINT("delay timer not expired");
+    driver_select(data->port, FD2EVENT(inj->delay_fd),
+                  ERL_DRV_READ | ERL_DRV_USE, 0);
+    inj->delaying = false;
+    output_ready(data, inj->delayed_deadline);
+}
+
+/* A tick still held back is delivered when injection is turned off, but
+ * not when the port is closing */
+static void remove_injector(timer_data *data, bool deliver)
+{
+    injector *inj = data->inject;
+
+    if(!inj)
+        return;
+
+    if(inj->delaying && deliver)
+        deliver_delayed(data);
+    if(inj->delay_fd >= 0)
+    {
+        driver_select(data->port, FD2EVENT(inj->delay_fd), ERL_DRV_READ, 0);
+        close(inj->delay_fd);
+    }
+    driver_free(inj);
+    data->inject = NULL;
+}
+
+static int decode_number(ei_x_buff *in_x_buff, double *d)
+{
+    int type, size;
+    long n;
+
+    if(ei_x_get_type(in_x_buff, &type, &size) != 0)
+        return -1;
+
+    if(type == ERL_FLOAT_EXT || type == NEW_FLOAT_EXT)
+        return ei_x_decode_double(in_x_buff, d);
+
+    if(ei_x_decode_long(in_x_buff, &n) != 0)
+        return -1;
+    *d = n;
+    return 0;
+}
+
+static int decode_inject_option(injector *inj, ei_x_buff *in_x_buff)
+{
+    char name[MAXATOMLEN], kind[MAXATOMLEN];
+    unsigned long long seed;
+    int arity = 0;
+    double period, duration;
+    long count;
+
+    if(ei_x_decode_tuple_header(in_x_buff, &arity) != 0
+       || ei_x_decode_atom(in_x_buff, name) != 0)
+        return -1;
+
+    if(strcmp(name, ATOM_SEED) == 0 && arity == 2)
+    {
+        if(ei_x_decode_ulonglong(in_x_buff, &seed) != 0)
+            return -1;
+        inj->state = seed ? seed : inj->state;
+        return 0;
+    }
+
+    if(strcmp(name, ATOM_DROP) == 0 && arity == 2)
+        return decode_number(in_x_buff, &inj->drop) != 0
+            || inj->drop < 0 || inj->drop > 1 ? -1 : 0;
+
+    if(strcmp(name, ATOM_DELAY) == 0 && arity == 2)
+    {
+        if(ei_x_decode_tuple_header(in_x_buff, &arity) != 0 || arity != 3
+           || ei_x_decode_atom(in_x_buff, kind) != 0
+           || decode_number(in_x_buff, &inj->delay_a) != 0
+           || decode_number(in_x_buff, &inj->delay_b) != 0)
+            return -1;
+
+        if(strcmp(kind, ATOM_UNIFORM) == 0
+           && inj->delay_a >= 0 && inj->delay_b >= inj->delay_a)
+            inj->delay = DELAY_UNIFORM;
+        else if(strcmp(kind, ATOM_LOGNORMAL) == 0 && inj->delay_b >= 0)
+            inj->delay = DELAY_LOGNORMAL;
+        else
+            return -1;
+        return 0;
+    }
+
+    if(strcmp(name, ATOM_STALL) == 0 && arity == 3)
+    {
+        if(decode_number(in_x_buff, &period) != 0 || period <= 0
+           || period * 1000.0 > INJECT_MAX_DELAY
+           || decode_number(in_x_buff, &duration) != 0 || duration < 0
+           || duration > INJECT_MAX_DELAY)
+            return -1;
+        inj->stall_period = (int64_t)(period * 1000000.0);
+        inj->stall_duration = (int64_t)(duration * 1000.0);
+        return 0;
+    }
+
+    if(strcmp(name, ATOM_BURST) == 0 && arity == 3)
+    {
+        if(decode_number(in_x_buff, &inj->burst) != 0
+           || inj->burst < 0 || inj->burst > 1
+           || ei_x_decode_long(in_x_buff, &count) != 0 || count < 0)
+            return -1;
+        inj->burst_count = count;
+        return 0;
+    }
+
+    return -1;
+}
+
+static int set_injector(timer_data *data, ei_x_buff *in_x_buff)
+{
+    char atom[MAXATOMLEN];
+    int type, size, count = 0, i;
+    injector *inj;
+
+    ei_x_get_type(in_x_buff, &type, &size);
+    if(type == ERL_ATOM_EXT)
+    {
+        if(ei_x_decode_atom(in_x_buff, atom) != 0
+           || strcmp(atom, ATOM_OFF) != 0)
+            return -1;
+        remove_injector(data, true);
+        return 0;
+    }
+
+    if(ei_x_decode_list_header(in_x_buff, &count) != 0
+       || !(inj = driver_alloc(sizeof(injector))))
+        return -1;
+
+    inject_init(inj, 0);
+    for(i = 0; i < count; i++)
+    {
+        if(decode_inject_option(inj, in_x_buff) != 0)
+        {
+            driver_free(inj);
+            return -1;
+        }
+    }
+
+    /* Skip the tail of a proper list */
+    if(count > 0)
+        ei_x_decode_list_header(in_x_buff, &count);
+
+    if(inj->delay != DELAY_NONE || inj->stall_period > 0)
+    {
+        inj->delay_fd = timerfd_create(CLOCK_MONOTONIC,
+                                       TFD_NONBLOCK | TFD_CLOEXEC);
+        if(inj->delay_fd < 0)
+        {
+            driver_free(inj);
+            return -1;
+        }
+    }
+
+    remove_injector(data, true);
+    data->inject = inj;
+    return 0;
+}
+
+static int set_option(timer_data *data, const char *name,
+                      ei_x_buff *in_x_buff)
+{
+    char atom[MAXATOMLEN];
+    int type, size;
+    long value;
+
+    if(strcmp(name, ATOM_PRIORITY) == 0)
+    {
+        ei_x_get_type(in_x_buff, &type, &size);
+        if(type == ERL_ATOM_EXT)
+        {
+            if(ei_x_decode_atom(in_x_buff, atom) != 0
+               || strcmp(atom, ATOM_UNDEFINED) != 0)
+                return -1;
+            data->prioritized = false;
+            data->priority = 0;
+        }
+        else
+        {
+            if(ei_x_decode_long(in_x_buff, &data->priority) != 0)
+                return -1;
+            data->prioritized = true;
+        }
+        return 0;
+    }
+
+    if(strcmp(name, ATOM_INJECT) == 0)
+        return set_injector(data, in_x_buff);
+
+    if(strcmp(name, ATOM_PM_QOS) == 0)
+    {
+        ei_x_get_type(in_x_buff, &type, &size);
+        if(type == ERL_ATOM_EXT)
+        {
+            if(ei_x_decode_atom(in_x_buff, atom) != 0
+               || strcmp(atom, ATOM_FALSE) != 0)
+                return -1;
+            value = -1;
+        }
+        else if(ei_x_decode_long(in_x_buff, &value) != 0
+                || value < 0 || value > INT32_MAX)
+            return -1;
+
+        /* Drop the old request so a new target is written out */
+        pmqos_release(&data->qos);
+        data->qos.target = (int32_t)value;
+        data->qos_errno = 0;
+        update_pmqos(data);
+        return 0;
+    }
+
+    if(strcmp(name, ATOM_NAME) == 0)
+    {
+        if(ei_x_decode_atom(in_x_buff, atom) != 0)
+            return -1;
+        metrics_set_name(&data->metrics, atom);
+        return 0;
+    }
+
+    if(strcmp(name, ATOM_LATENESS_SLO) == 0)
+    {
+        if(ei_x_decode_long(in_x_buff, &value) != 0 || value < 0)
+            return -1;
+        METRIC_SET(data->metrics.slo, (int64_t)value * 1000);
+        return 0;
+    }
+
+    LOGGER_PRINT("%s is bad option", name);
+    return -1;
+}
+
+static ErlDrvSSizeT setopts(timer_data *data, ei_x_buff *in_x_buff,
+                            ei_x_buff *out_x_buff)
+{
+    char name[MAXATOMLEN];
+    int count = 0, arity = 0, i;
+
+    if(ei_x_decode_list_header(in_x_buff, &count) != 0)
+        return -1; /* badarg */
+
+    for(i = 0; i < count; i++)
+    {
+        if(ei_x_decode_tuple_header(in_x_buff, &arity) != 0 || arity != 2
+           || ei_x_decode_atom(in_x_buff, name) != 0
+           || set_option(data, name, in_x_buff) != 0)
+            return -1; /* badarg */
+    }
+
+    encode_ok(out_x_buff);
+    return out_x_buff->index;
+}
+
+/* Apply the queued settime requests. Every request rearms the same timer so
+ * only the most recent one has any effect, the rest are just counted. */
+static void flush_queue(timer_data *data)
+{
+    settime_request *req;
+
+    if(data->queue_len == 0)
+        return;
+
+    cancel_schedule(data);
+    req = &data->queue[data->queue_len - 1];
+    if(arm_timer(data, req->flags, &req->value, NULL) != 0)
+    {
+        LOGGER_PRINT("async timerfd_settime failed");
+        METRIC_ADD(data->metrics.async_errors, 1);
+    }
+
+    METRIC_ADD(data->metrics.async_batches, 1);
+    if(data->queue_len > data->metrics.async_max_batch)
+        METRIC_SET(data->metrics.async_max_batch, data->queue_len);
+
+    data->queue_len = 0;
+}
+
 static int init(void)
 {
+    am_timerfd = driver_mk_atom("timerfd");
+    am_ready = driver_mk_atom("ready");
     LOGGER_OPEN(MODULE, LOGFILE);
+    metrics_init();
+    native_init();
+    pmqos_init();
     LOGGER_PRINT("driver loaded");
     return 0;
 }
 
 static void finish(void)
 {
+    metrics_finish();
+    native_finish();
+    pmqos_finish();
     LOGGER_PRINT("driver unloaded");
     LOGGER_CLOSE();
 }
@@ -222,6 +1152,24 @@ static ErlDrvData start(ErlDrvPort port, char *cmd)
         set_port_control_flags(port, PORT_CONTROL_FLAG_BINARY);
         data->port = port;
         data->fd = -1;
+        data->clockid = CLOCK_MONOTONIC;
+        data->deadline = 0;
+        data->interval = 0;
+        data->prioritized = false;
+        data->priority = 0;
+        data->pending = 0;
+        data->schedule = NULL;
+        data->inject = NULL;
+        data->notified = false;
+        data->qos.target = -1;
+        data->qos.active = false;
+        data->qos_errno = 0;
+        memset(data->qos_ticks, 0, sizeof(data->qos_ticks));
+        memset(data->qos_lateness, 0, sizeof(data->qos_lateness));
+        data->probe_efd = -1;
+        data->probe_handle = 0;
+        data->queue_len = 0;
+        memset(&data->metrics, 0, sizeof(data->metrics));
         LOGGER_PRINT("port opened");
     }
     else
@@ -236,12 +1184,22 @@ static void stop(ErlDrvData handle)
 {
     timer_data *data = (timer_data *)handle;
 
-    if(data->fd)
+    if(data->fd >= 0)
     {
         driver_select(data->port, FD2EVENT(data->fd), ERL_DRV_READ, 0);
         close(data->fd);
+        metrics_unregister(&data->metrics);
+        native_timer_closed(data->metrics.id);
     }
 
+    if(data->probe_handle > 0)
+        timerfd_get_abi(TIMERFD_ABI_VERSION)->unsubscribe(data->probe_handle);
+    if(data->probe_efd >= 0)
+        close(data->probe_efd);
+
+    pmqos_release(&data->qos);
+    cancel_schedule(data);
+    remove_injector(data, false);
     driver_free(data);
     LOGGER_PRINT("port closed");
 }
@@ -283,6 +1241,38 @@ static ErlDrvSSizeT control(ErlDrvData handle,
         tmp = read_timer(data, &in_x_buff, &out_x_buff);
         break;
 
+    case STATS:
+        tmp = stats(data, &in_x_buff, &out_x_buff);
+        break;
+
+    case SETOPTS:
+        tmp = setopts(data, &in_x_buff, &out_x_buff);
+        break;
+
+    case EXPORT:
+        tmp = export_metrics(data, &in_x_buff, &out_x_buff);
+        break;
+
+    case SCHEDULE:
+        tmp = set_schedule(data, &in_x_buff, &out_x_buff);
+        break;
+
+    case ANALYZE:
+        tmp = analyze(data, &in_x_buff, &out_x_buff);
+        break;
+
+    case SUBSCRIBERS:
+        tmp = subscribers(data, &in_x_buff, &out_x_buff);
+        break;
+
+    case CLOCK:
+        tmp = clock_time(data, &in_x_buff, &out_x_buff);
+        break;
+
+    case PROBE:
+        tmp = probe(data, &in_x_buff, &out_x_buff);
+        break;
+
     default:
         tmp = -1; /* badarg */
         break;
@@ -299,21 +1289,99 @@ static ErlDrvSSizeT control(ErlDrvData handle,
     return tmp;
 }
 
+/* Queue settime requests sent with port_command. The queue is drained from
+ * the timeout callback so that requests arriving while the port is busy are
+ * applied together. */
+static void output(ErlDrvData handle, char *buf, ErlDrvSizeT len)
+{
+    timer_data *data = (timer_data *)handle;
+    const unsigned char *rec = (const unsigned char *)buf;
+    settime_request *req;
+
+    if(data->fd < 0 || len == 0 || len % ASYNC_RECORD_SIZE != 0)
+    {
+        LOGGER_PRINT("bad async settime request");
+        METRIC_ADD(data->metrics.async_errors, 1);
+        return;
+    }
+
+    for(; len > 0; len -= ASYNC_RECORD_SIZE, rec += ASYNC_RECORD_SIZE)
+    {
+        if(data->queue_len == ASYNC_QUEUE_SIZE)
+        {
+            METRIC_ADD(data->metrics.async_queue_full, 1);
+            flush_queue(data);
+        }
+
+        req = &data->queue[data->queue_len++];
+        req->value.it_interval.tv_sec = get_int64(rec);
+        req->value.it_interval.tv_nsec = get_int64(rec + 8);
+        req->value.it_value.tv_sec = get_int64(rec + 16);
+        req->value.it_value.tv_nsec = get_int64(rec + 24);
+        req->flags = rec[32] ? TFD_TIMER_ABSTIME : 0;
+        METRIC_ADD(data->metrics.async_requests, 1);
+    }
+
+    driver_set_timer(data->port, 0);
+}
+
+static void timeout(ErlDrvData handle)
+{
+    flush_queue((timer_data *)handle);
+}
+
 static void ready_input(ErlDrvData handle, ErlDrvEvent event)
 {
     timer_data *data = (timer_data *)handle;
-    ei_x_buff x;
+    int64_t now, deadline;
+    uint64_t expirations;
+    int held;
 
     if(EVENT2FD(event) == data->fd)
     {
         LOGGER_PRINT("ready");
-        driver_select(data->port, FD2EVENT(data->fd),
-                      ERL_DRV_READ | ERL_DRV_USE, 0);
-        ei_x_new_with_version(&x);
-        ei_x_encode_tuple_header(&x, 2);
-        ei_x_encode_atom(&x, "timerfd");
-        ei_x_encode_atom(&x, "ready");
-        driver_output(data->port, x.buff, x.index);
+        now = clock_now(data);
+        deadline = last_deadline(data, now);
+        METRIC_ADD(data->metrics.ticks, 1);
+        metrics_observe_lateness(&data->metrics, now - deadline);
+        held = pmqos_held() ? 1 : 0;
+        data->qos_ticks[held]++;
+        data->qos_lateness[held] += now - deadline;
+
+        /* Native subscribers get every expiration, so the driver reads
+         * the timer itself and leaves it selected */
+        if(METRIC_GET(data->metrics.subscribers) > 0)
+        {
+            if(read(data->fd, &expirations, sizeof(expirations)) > 0)
+            {
+                data->pending += expirations;
+                native_notify(data->metrics.id, expirations, deadline);
+            }
+        }
+        else
+            driver_select(data->port, FD2EVENT(data->fd),
+                          ERL_DRV_READ | ERL_DRV_USE, 0);
+
+        if(data->schedule)
+            advance_schedule(data);
+
+        /* A one shot timer is disarmed once it has fired */
+        if(data->interval == 0 && !data->schedule && data->deadline != 0)
+        {
+            data->deadline = 0;
+            update_pmqos(data);
+        }
+
+        if(data->notified)
+            return;
+
+        data->notified = true;
+        if(!data->inject || inject_fault(data, now, deadline))
+            output_ready(data, deadline);
+    }
+    else if(data->inject && EVENT2FD(event) == data->inject->delay_fd)
+    {
+        deliver_delayed(data);
     }
     else
     {
@@ -330,16 +1398,16 @@ ErlDrvEntry timerfd_entry =
     init,                           /* init */
     start,                          /* start */
     stop,                           /* stop */
-    NULL,                           /* output */
+    output,                         /* output */
     ready_input,                    /* ready_input */
     NULL,                           /* ready_output */
     MODULE,                         /* driver name */
     finish,                         /* finish */
     NULL,                           /* VM reserved */
     control,                        /* control */
-    NULL,                           /* timeout */
+    timeout,                        /* timeout */
     NULL,                           /* outputv */
-    NULL,                           /* ready_async */
+    ready_async,                    /* ready_async */
     NULL,                           /* flush */
     NULL,                           /* call */
     NULL,                           /* event */
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2016, Mark Jones <markalanj@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * The names of its contributors may not be used to endorse or promote
+ * products derived from this software without specific prior written
+ * permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Native subscription interface of the timerfd driver.
+ *
+ * Other NIFs and drivers loaded into the same emulator can have the driver
+ * signal them directly on every expiration of a timer, without a round trip
+ * through an Erlang process. Look the interface up once the driver is
+ * loaded:
+ *
+ *     void *lib = dlopen(".../priv/timerfd.so", RTLD_NOW | RTLD_NOLOAD);
+ *     timerfd_get_abi_fn get_abi = (timerfd_get_abi_fn)
+ *         dlsym(lib, TIMERFD_GET_ABI_SYMBOL);
+ *     const timerfd_abi *abi = get_abi(TIMERFD_ABI_VERSION);
+ *
+ * get_abi() returns NULL when the driver does not implement the requested
+ * version. Timers are identified by the id reported by timerfd:stats/1 or
+ * found by the name set with timerfd:setopts/2.
+ *
+ * Callbacks run on the scheduler thread serving the timer's port and must
+ * return quickly. They must not subscribe or unsubscribe. An eventfd
+ * subscriber has the number of expirations added to its counter instead.
+ * Subscriptions end when the timer is closed; a callback then gets a last
+ * call with zero expirations. Unsubscribe before the driver is unloaded.
+ *
+ * While a timer has native subscribers the driver reads the timer itself
+ * and calls them on every expiration. The Erlang owner still gets one ready
+ * message at a time and read/1 returns the expirations since its last
+ * read. A subscription made while a ready message is outstanding starts
+ * after the owner's next read.
+ */
+
+#ifndef TIMERFD_ABI_H
+#define TIMERFD_ABI_H
+
+#include <stdint.h>
+
+#define TIMERFD_ABI_VERSION     1
+#define TIMERFD_GET_ABI_SYMBOL  "timerfd_get_abi"
+
+/* Deadline is the expiration that fired, in ns on the timer's clock */
+typedef void (*timerfd_tick_fn)(void *arg, uint64_t expirations,
+                                int64_t deadline);
+
+typedef struct
+{
+    uint64_t calls;
+    uint64_t total_ns;      /* time spent in the subscriber */
+    uint64_t max_ns;
+} timerfd_subscriber_stats;
+
+/* All functions return 0 or a positive handle on success and a negative
+ * errno value on failure */
+typedef struct
+{
+    uint32_t version;
+    uint32_t size;          /* sizeof(timerfd_abi) */
+    int (*find)(const char *name, unsigned long *timer_id);
+    int (*subscribe)(unsigned long timer_id, timerfd_tick_fn fn, void *arg);
+    int (*subscribe_eventfd)(unsigned long timer_id, int efd);
+    int (*unsubscribe)(int handle);
+    int (*stats)(int handle, timerfd_subscriber_stats *stats);
+} timerfd_abi;
+
+typedef const timerfd_abi *(*timerfd_get_abi_fn)(uint32_t version);
+
+const timerfd_abi *timerfd_get_abi(uint32_t version);
+
+#endif
+
@@ -46,6 +46,18 @@
 -define(SETTIME, 1).
 -define(GETTIME, 2).
 -define(READ, 3).
+-define(STATS, 4).
+-define(SETOPTS, 5).
+-define(EXPORT, 6).
+-define(SCHEDULE, 7).
+-define(ANALYZE, 8).
+-define(SUBSCRIBERS, 9).
+-define(CLOCK, 10).
+-define(PROBE, 11).
+
+-define(EXPORTER, timerfd_exporter).
+
+-on_load(init_ready_counters/0).
 
 %% API exports
 -export([
@@ -55,16 +67,51 @@
          close/1,
          set_time/3,
          set_time/2,
+         set_interval/2,
+         set_time_async/3,
+         set_schedule/3,
          get_time/1,
-         read/1
+         clock_time/1,
+         read/1,
+         stats/1,
+         subscribers/1,
+         probe/1,
+         drain_probe/1,
+         setopts/2,
+         collect_ready/1,
+         ready_stats/0,
+         export_metrics/1,
+         analyze/2
         ]).
 
+%% proc_lib callback
+-export([export_owner/2]).
+
 -type timer() :: port().
 -type clockid() :: clock_monotonic | clock_realtime.
 -type timespec() :: { Seconds :: non_neg_integer(),
                       Nanoseconds :: non_neg_integer() }.
 -type itimerspec() :: { Interval :: timespec(), Initial :: timespec() }.
 
+-export_type([timer/0, timespec/0, itimerspec/0]).
+-type option() :: {priority, integer() | undefined}
+                | {name, atom()}
+                | {lateness_slo, non_neg_integer()}
+                | {pm_qos, non_neg_integer() | false}
+                | {inject, off | [inject_option()]}.
+-type inject_option() :: {seed, pos_integer()}
+                       | {drop, Probability :: number()}
+                       | {delay, {uniform, MinUs :: number(),
+                                  MaxUs :: number()}}
+                       | {delay, {lognormal, Mu :: number(),
+                                  Sigma :: number()}}
+                       | {stall, PeriodMs :: number(), DurationUs :: number()}
+                       | {burst, Probability :: number(),
+                          Expirations :: non_neg_integer()}.
+-type export_target() :: {file, file:filename(), IntervalMs :: pos_integer()}
+                       | {unix, file:filename()}
+                       | stop.
+
 %%=============================================================================
 %% API functions
 %%=============================================================================
@@ -155,6 +202,68 @@ set_time(Timer, {IntervalSeconds, IntervalNanoseconds}) ->
     set_time(Timer, {{IntervalSeconds,IntervalNanoseconds},
                      {IntervalSeconds,IntervalNanoseconds}}).
 
+-spec set_interval(Timer, Microseconds) -> {ok, CurrentValue} when
+      Timer :: timer(),
+      Microseconds :: non_neg_integer(),
+      CurrentValue :: itimerspec().
+%% @doc Arms the timer to expire every Microseconds, the first time
+%% Microseconds from now. Zero disarms the timer.
+%% @see set_time/2
+
+set_interval(Timer, Microseconds)
+  when is_integer(Microseconds), Microseconds >= 0 ->
+    set_time(Timer, {Microseconds div 1000000,
+                     Microseconds rem 1000000 * 1000}).
+
+-spec set_time_async(Timer, NewValue, Absolute) -> ok | busy when
+      Timer :: timer(),
+      NewValue :: itimerspec() | timespec(),
+      Absolute :: boolean().
+%% @doc Arms or disarms the timer like set_time/3 without waiting for the
+%% port. The request is queued as a fixed size record and applied by the
+%% driver together with any other requests queued in the meantime, only the
+%% most recent one taking effect. Returns busy, without queueing the request,
+%% if the port is busy.
+%% @see set_time/3
+
+set_time_async(Timer,
+               {{IntervalSeconds, IntervalNanoseconds},
+                {InitialSeconds, InitialNanoseconds}},
+               Absolute)
+  when IntervalSeconds > -1, IntervalNanoseconds > -1,
+       InitialSeconds > -1, InitialNanoseconds > -1, is_boolean(Absolute) ->
+    Flag = case Absolute of
+               true -> 1;
+               false -> 0
+           end,
+    Record = <<IntervalSeconds:64, IntervalNanoseconds:64,
+               InitialSeconds:64, InitialNanoseconds:64, Flag:8>>,
+    case erlang:port_command(Timer, Record, [nosuspend]) of
+        true -> ok;
+        false -> busy
+    end;
+set_time_async(Timer, {IntervalSeconds, IntervalNanoseconds}, Absolute) ->
+    set_time_async(Timer, {{IntervalSeconds, IntervalNanoseconds},
+                           {IntervalSeconds, IntervalNanoseconds}}, Absolute).
+
+-spec set_schedule(Timer, Intervals, Loop) -> ok | {error, Reason} when
+      Timer :: timer(),
+      Intervals :: [non_neg_integer()],
+      Loop :: boolean(),
+      Reason :: string().
+%% @doc Arms the timer to expire after each of Intervals nanoseconds in turn,
+%% starting from now, and to start over when Loop is true. Every expiration
+%% is armed as an absolute deadline so lateness does not accumulate. Ready
+%% messages work as usual, read/1 returns the expirations of the ticks
+%% delivered so far. set_time/3 cancels the schedule. An interval that is
+%% not a non-negative integer raises badarg.
+
+set_schedule(Timer, Intervals = [_ | _], Loop) when is_boolean(Loop) ->
+    Binary = << <<(schedule_interval(Interval)):64>>
+                || Interval <- Intervals >>,
+    binary_to_term(port_control(Timer, ?SCHEDULE,
+                                term_to_binary({Binary, Loop}))).
+
 -spec get_time(Timer) -> {ok, CurrentValue} when
       Timer :: timer(),
       CurrentValue :: itimerspec().
@@ -163,6 +272,15 @@ set_time(Timer, {IntervalSeconds, IntervalNanoseconds}) ->
 get_time(Timer) ->
     binary_to_term(port_control(Timer, ?GETTIME, term_to_binary([]))).
 
+-spec clock_time(Timer) -> {ok, Nanoseconds} when
+      Timer :: timer(),
+      Nanoseconds :: integer().
+%% @doc Returns the current time of the timer's clock, the time base of
+%% absolute set_time/3 values and of priority ready message deadlines.
+
+clock_time(Timer) ->
+    binary_to_term(port_control(Timer, ?CLOCK, term_to_binary([]))).
+
 -spec read(Timer) -> {ok, Expirations}
                          | {error, ewouldblock} 
                          | {error, Errno} when
@@ -178,6 +296,217 @@ get_time(Timer) ->
 read(Timer) ->
     binary_to_term(port_control(Timer, ?READ, term_to_binary([]))).
 
+-spec stats(Timer) -> {ok, Stats} when
+      Timer :: timer(),
+      Stats :: [{atom(), non_neg_integer() | boolean()}].
+%% @doc Returns the driver statistics for the timer. The async_* counters
+%% cover set_time_async/3: requests received, batches applied, the largest
+%% batch and how often the request queue filled up before it was drained.
+%% The pm_qos_* entries tell whether the timer holds the PM QoS hint (a
+%% boolean), the target the node has written and the last errno taking it
+%% failed with.
+%% lateness_mean_pm_qos and lateness_mean_no_pm_qos average the timer's
+%% wakeup lateness in microseconds over ticks with and without the hint
+%% held by the node, their difference being what the hint bought.
+
+stats(Timer) ->
+    binary_to_term(port_control(Timer, ?STATS, term_to_binary([]))).
+
+-spec subscribers(Timer) -> {ok, Subscribers} when
+      Timer :: timer(),
+      Subscribers :: [{Handle :: pos_integer(),
+                       Calls :: non_neg_integer(),
+                       TotalNs :: non_neg_integer(),
+                       MaxNs :: non_neg_integer()}].
+%% @doc Returns the native subscribers of the timer with the number of
+%% callbacks made and the time spent in them. Native code subscribes
+%% through the ABI declared in c_src/timerfd_abi.h, naming the timer with
+%% the name option. While a timer has subscribers the driver reads every
+%% expiration itself, so read/1 still returns the full count.
+
+subscribers(Timer) ->
+    binary_to_term(port_control(Timer, ?SUBSCRIBERS, term_to_binary([]))).
+
+-spec probe(Name) -> {ok, Probe, Handle} | {error, Reason} when
+      Name :: atom(),
+      Probe :: port(),
+      Handle :: pos_integer(),
+      Reason :: term().
+%% @doc Subscribes an eventfd to the timer named Name through the native
+%% subscriber ABI, the way native code would, to check that path from
+%% Erlang. Handle is the subscription as listed by subscribers/1.
+%% drain_probe/1 returns the expirations signalled so far, close/1 ends the
+%% subscription.
+%% @see subscribers/1
+
+probe(Name) when is_atom(Name) ->
+    case start() of
+        ok ->
+            Probe = open_port({spawn, atom_to_list(?MODULE)}, [binary]),
+            case binary_to_term(port_control(Probe, ?PROBE,
+                                             term_to_binary({subscribe, Name})))
+            of
+                {ok, Handle} ->
+                    {ok, Probe, Handle};
+                Error ->
+                    close(Probe),
+                    Error
+            end;
+        Other ->
+            Other
+    end.
+
+-spec drain_probe(Probe) -> {ok, Expirations} | {error, Reason} when
+      Probe :: port(),
+      Expirations :: non_neg_integer(),
+      Reason :: string().
+%% @doc Returns the expirations signalled to the probe since the last drain.
+%% @see probe/1
+
+drain_probe(Probe) ->
+    binary_to_term(port_control(Probe, ?PROBE, term_to_binary(drain))).
+
+-spec setopts(Timer, Options) -> ok when
+      Timer :: timer(),
+      Options :: [option()].
+%% @doc Sets timer options.
+%%
+%% `{priority, Priority}' makes the driver send
+%% `{Timer, {timerfd, ready, Priority, Deadline}}' instead of the usual
+%% binary ready message, Deadline being the expiration that fired in
+%% nanoseconds on the timer's clock. Such messages are meant to be received
+%% with collect_ready/1. `{priority, undefined}' restores the usual message.
+%%
+%% `{name, Name}' labels the timer in exported metrics.
+%%
+%% `{lateness_slo, Microseconds}' counts wakeups later than Microseconds
+%% after the expiration as objective violations, 0 turns it off.
+%%
+%% `{pm_qos, Microseconds}' holds a /dev/cpu_dma_latency request while the
+%% timer is armed, keeping idle CPUs out of C-states slower to leave than
+%% Microseconds. The node writes the lowest target of all armed timers and
+%% drops the request when the last one is disarmed, fires as a one shot or
+%% is closed. When the file cannot be opened the timer runs without the hint
+%% and stats/1 reports the errno as `pm_qos_errno'. The file is not tried
+%% again until the option is set again. `{pm_qos, false}' turns it off.
+%%
+%% `{inject, Faults}' makes the driver mistreat ticks to test how consumers
+%% cope with bad timing, `{inject, off}' stops it. Faults is a list of:
+%% <ul>
+%% <li>`{drop, P}' drops a tick with probability P, its expirations are
+%% never read.</li>
+%% <li>`{delay, {uniform, Min, Max}}' delays every tick by Min to Max
+%% microseconds.</li>
+%% <li>`{delay, {lognormal, Mu, Sigma}}' delays every tick by a lognormal
+%% number of microseconds, Mu and Sigma being those of its logarithm.</li>
+%% <li>`{stall, Period, Duration}' holds ticks falling into the first
+%% Duration microseconds of every Period milliseconds until the stall
+%% ends.</li>
+%% <li>`{burst, P, N}' adds N expirations to the next read with probability
+%% P.</li>
+%% <li>`{seed, Seed}' seeds the random numbers so a run can be
+%% reproduced.</li>
+%% </ul>
+%% Probabilities must lie between 0 and 1. No tick is delayed or stalled
+%% for longer than an hour, a longer stall or stall period is rejected.
+%% @see collect_ready/1
+%% @see export_metrics/1
+
+setopts(Timer, Options) when is_list(Options) ->
+    binary_to_term(port_control(Timer, ?SETOPTS, term_to_binary(Options))).
+
+-spec collect_ready(Timeout) -> {ok, [Ready]} | timeout when
+      Timeout :: timeout(),
+      Ready :: {timer(), Priority :: integer(), Deadline :: integer()}.
+%% @doc Waits for a ready message from a timer with a priority and then
+%% collects every other such message already in the mailbox. The ready timers
+%% are returned highest priority first, earliest deadline first within a
+%% priority. How often this differs from the arrival order is reported by
+%% ready_stats/0. Each timer still has to be read with read/1.
+%% @see setopts/2
+
+collect_ready(Timeout) ->
+    receive
+        {Timer, {timerfd, ready, Priority, Deadline}} when is_port(Timer) ->
+            Ready = [{Timer, Priority, Deadline} | collect_pending_ready()],
+            Sorted = lists:sort(fun ready_before/2, Ready),
+            count_ready_round(Sorted =/= Ready),
+            {ok, Sorted}
+    after
+        Timeout -> timeout
+    end.
+
+-spec ready_stats() -> [{rounds | reordered, non_neg_integer()}].
+%% @doc Returns the number of collect_ready/1 rounds in this node and how
+%% many of them delivered the timers in a different order than they arrived.
+
+ready_stats() ->
+    Counters = ready_counters(),
+    [{rounds, counters:get(Counters, 1)},
+     {reordered, counters:get(Counters, 2)}].
+
+-spec export_metrics(Target) -> ok | {error, Reason} when
+      Target :: export_target(),
+      Reason :: string().
+%% @doc Starts or stops exporting timer statistics in OpenMetrics text
+%% format from a driver thread, so collectors never touch the emulator.
+%% `{file, Path, IntervalMs}' atomically rewrites Path every IntervalMs
+%% milliseconds. `{unix, Path}' serves the metrics on a UNIX domain socket,
+%% as an HTTP response when the client sends a GET request and as plain text
+%% otherwise. Only one export runs at a time. It is owned by a process
+%% registered as `timerfd_exporter', which keeps the driver loaded until any
+%% process stops the export or the process that started it exits. `stop'
+%% returns `{error, "not running"}' when no export is running.
+
+export_metrics(stop) ->
+    case whereis(?EXPORTER) of
+        undefined ->
+            {error, "not running"};
+        Owner ->
+            MRef = monitor(process, Owner),
+            Owner ! {stop, self(), MRef},
+            receive
+                {MRef, Reply} ->
+                    demonitor(MRef, [flush]),
+                    Reply;
+                {'DOWN', MRef, _, _, _} ->
+                    {error, "not running"} % starter exited meanwhile
+            end
+    end;
+export_metrics({file, Path, IntervalMs})
+  when is_integer(IntervalMs), IntervalMs > 0 ->
+    start_export({file, filename_to_binary(Path), IntervalMs});
+export_metrics({unix, Path}) ->
+    start_export({unix, filename_to_binary(Path)}).
+
+-spec analyze(Samples, MaxPeaks) -> {ok, [Peak]} | {error, Reason} when
+      Samples :: [number()],
+      MaxPeaks :: non_neg_integer(),
+      Peak :: {Period :: float(), Amplitude :: float(), Share :: float()},
+      Reason :: term().
+%% @doc Finds the strongest periodic components of a series sampled at a
+%% regular interval, such as the lateness of successive ticks. Each peak
+%% gives the period in samples, the amplitude in the unit of the samples and
+%% the share of the series' variance it accounts for, strongest first. At
+%% most 32 peaks are returned. Series longer than 4096 samples are cut
+%% into half overlapping segments whose spectra are averaged, so periods
+%% must be shorter than that. The analysis runs on a driver async thread
+%% and takes about a second per ten million samples.
+
+analyze(Samples, MaxPeaks) when is_list(Samples), is_integer(MaxPeaks),
+                                MaxPeaks >= 0 ->
+    Binary = << <<(float(Sample)):64/float-native>> || Sample <- Samples >>,
+    case start() of
+        ok ->
+            try
+                driver_async(?ANALYZE, {Binary, MaxPeaks})
+            after
+                stop()
+            end;
+        Other ->
+            Other
+    end.
+
 %%=============================================================================
 %% Internal functions
 %%=============================================================================
@@ -186,10 +515,112 @@ read(Timer) ->
       ClockId :: clockid().
 
 open_port_and_create_timer(ClockId) ->
-    Timer = open_port({spawn, atom_to_list(?MODULE)}, [binary]),
+    Timer = open_port({spawn, atom_to_list(?MODULE)},
+                      [binary, {parallelism, true}]),
     case binary_to_term(port_control(Timer, ?CREATE, term_to_binary(ClockId)))
     of
         ok -> {ok, Timer};
         Other -> Other
     end.
 
+start_export(Target) ->
+    proc_lib:start(?MODULE, export_owner, [self(), Target]).
+
+%% Holds the driver reference and the registered name of a running export,
+%% and stops it when asked to or when the process that started it exits
+export_owner(Starter, Target) ->
+    case catch register(?EXPORTER, self()) of
+        true ->
+            case start() of
+                ok ->
+                    case driver_control(?EXPORT, Target) of
+                        ok ->
+                            proc_lib:init_ack(ok),
+                            export_loop(monitor(process, Starter));
+                        Error ->
+                            proc_lib:init_ack(Error)
+                    end,
+                    stop();
+                Error ->
+                    proc_lib:init_ack(Error)
+            end;
+        _ ->
+            proc_lib:init_ack({error, "already running"})
+    end.
+
+export_loop(MRef) ->
+    receive
+        {stop, From, Ref} ->
+            From ! {Ref, driver_control(?EXPORT, stop)};
+        {'DOWN', MRef, _, _, _} ->
+            driver_control(?EXPORT, stop)
+    end.
+
+schedule_interval(Interval) when is_integer(Interval), Interval >= 0 ->
+    Interval;
+schedule_interval(_) ->
+    error(badarg).
+
+filename_to_binary(Path) ->
+    unicode:characters_to_binary(Path, unicode, file:native_name_encoding()).
+
+%% Like driver_control/2 for commands the driver runs on an async thread,
+%% the result comes back as data from the port
+driver_async(Command, Term) ->
+    Port = open_port({spawn, atom_to_list(?MODULE)}, [binary]),
+    try binary_to_term(port_control(Port, Command, term_to_binary(Term))) of
+        ok ->
+            receive
+                {Port, {data, Result}} -> binary_to_term(Result)
+            end;
+        Error ->
+            Error
+    after
+        port_close(Port)
+    end.
+
+%% Run a control command that is not about a particular timer on a port
+%% without one.
+driver_control(Command, Term) ->
+    Port = open_port({spawn, atom_to_list(?MODULE)}, [binary]),
+    try
+        binary_to_term(port_control(Port, Command, term_to_binary(Term)))
+    after
+        port_close(Port)
+    end.
+
+collect_pending_ready() ->
+    receive
+        {Timer, {timerfd, ready, Priority, Deadline}} when is_port(Timer) ->
+            [{Timer, Priority, Deadline} | collect_pending_ready()]
+    after
+        0 -> []
+    end.
+
+ready_before({_, Priority, DeadlineA}, {_, Priority, DeadlineB}) ->
+    DeadlineA =< DeadlineB;
+ready_before({_, PriorityA, _}, {_, PriorityB, _}) ->
+    PriorityA > PriorityB.
+
+count_ready_round(Reordered) ->
+    Counters = ready_counters(),
+    counters:add(Counters, 1, 1),
+    case Reordered of
+        true -> counters:add(Counters, 2, 1);
+        false -> ok
+    end.
+
+ready_counters() ->
+    persistent_term:get({?MODULE, ready_counters}).
+
+%% Created once when the module is first loaded, so no caller ever races to
+%% create them and the hot path never writes a persistent term. A reload
+%% keeps the counts.
+init_ready_counters() ->
+    Key = {?MODULE, ready_counters},
+    case persistent_term:get(Key, undefined) of
+        undefined ->
+            persistent_term:put(Key, counters:new(2, [write_concurrency]));
+        _ ->
+            ok
+    end.
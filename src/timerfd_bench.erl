@@ -1,5 +1,5 @@
 -module(timerfd_bench).
--export([bench/2]).
+-export([bench/2, replay/1, analyze/2]).
 
 perf_loop(State = #{count := Count,
                     timer := Timer,
@@ -26,7 +26,7 @@ perf_loop(State = #{count := Count,
 perf_loop(State) -> {ok, State}.
 
 perf_print_stats(#{span_list := SpanList,
-                   expiration_list := ExpirationList}) ->
+                   expiration_list := ExpirationList}, DataFile) ->
     Spans = lists:sort(SpanList),
     Min = hd(Spans),
     Max = lists:last(Spans),
@@ -44,14 +44,48 @@ perf_print_stats(#{span_list := SpanList,
     PercLo = lists:nth(Len99lo, Spans),
     PercHi = lists:nth(Len99hi, Spans),
 
-    file:write_file("./plot/data.dat",
-                    lists:map(fun(N) -> [erlang:integer_to_binary(N), $\n] end, Spans)),
+    %% In the order observed so the file can be replayed
+    file:write_file(DataFile,
+                    lists:map(fun(N) -> [erlang:integer_to_binary(N), $\n] end,
+                              lists:reverse(SpanList))),
 
     Expirations = length(ExpirationList),
     io:format("min: ~p, avg: ~p, median: ~p max: ~p, std.dev: ~p, total: ~p~n", [Min, Avg, Med, Max, Std, Len]),
     io:format("99th percentile\tlo:~p\thi:~p~n", [PercLo, PercHi]),
     ok.
 
+%% Lateness of each tick against a regular schedule of Interval
+%% microseconds, from the observed spans and the expirations read per tick.
+lateness(Spans, Expirations, Interval) ->
+    {_, Lateness} =
+        lists:foldl(fun({Span, Expiration}, {Acc, Series}) ->
+                            Late = Acc + Span - Expiration * Interval,
+                            {Late, [Late | Series]}
+                    end, {0, []}, lists:zip(Spans, Expirations)),
+    lists:reverse(Lateness).
+
+print_interference(Lateness, Interval) ->
+    case timerfd:analyze(Lateness, 5) of
+        {ok, Peaks} ->
+            io:format("periodic interference:~n"),
+            lists:foreach(fun({Period, Amplitude, Share}) ->
+                                  io:format("\tperiod: ~.1f us\tamplitude: "
+                                            "~.2f us\tshare: ~.1f%~n",
+                                            [Period * Interval, Amplitude,
+                                             Share * 100])
+                          end, Peaks);
+        {error, Reason} ->
+            io:format("spectrum analysis failed: ~p~n", [Reason])
+    end.
+
+%% Look for periodic interference in spans written by bench/2 for a timer
+%% of Interval microseconds. Every span is taken as one expiration.
+analyze(File, Interval) ->
+    {ok, Profile} = timerfd_replay:load(File),
+    Spans = [Span / 1000 || Span <- Profile],
+    print_interference(lateness(Spans, [1 || _ <- Spans], Interval),
+                       Interval).
+
 bench(Interval, Count) ->
     {ok, Timer} = timerfd:create(clock_monotonic),
     {ok, _} = timerfd:set_time(Timer, {0,Interval*1000}),
@@ -60,6 +94,25 @@ bench(Interval, Count) ->
                   time => erlang:monotonic_time(micro_seconds),
                   span_list => [], expiration_list => []}),
     ok = timerfd:close(Timer),
+    {ok, State = #{span_list := SpanList,
+                   expiration_list := ExpirationList}} = Result,
+    perf_print_stats(State, "./plot/data.dat"),
+    print_interference(lateness(lists:reverse(SpanList),
+                                lists:reverse(ExpirationList), Interval),
+                       Interval),
+    ok.
+
+%% Replay a profile written by bench/2 and measure how closely it is
+%% reproduced. The observed spans go to ./plot/replay.dat.
+replay(File) ->
+    {ok, Profile} = timerfd_replay:load(File),
+    {ok, Timer} = timerfd:create(clock_monotonic),
+    ok = timerfd_replay:replay(Timer, {profile, Profile}, false),
+    Result = perf_loop(
+               #{ timer => Timer, count => length(Profile),
+                  time => erlang:monotonic_time(micro_seconds),
+                  span_list => [], expiration_list => []}),
+    ok = timerfd:close(Timer),
     {ok, State} = Result,
-    perf_print_stats(State),
+    perf_print_stats(State, "./plot/replay.dat"),
     ok.
@@ -0,0 +1,345 @@
+%%%============================================================================
+%%% Copyright (c) 2016, Mark Jones <markalanj@gmail.com>.
+%%% All rights reserved.
+%%%
+%%% Redistribution and use in source and binary forms, with or without
+%%% modification, are permitted provided that the following conditions are
+%%% met:
+%%%
+%%% * Redistributions of source code must retain the above copyright
+%%%   notice, this list of conditions and the following disclaimer.
+%%%
+%%% * Redistributions in binary form must reproduce the above copyright
+%%%   notice, this list of conditions and the following disclaimer in the
+%%%   documentation and/or other materials provided with the distribution.
+%%%
+%%% * The names of its contributors may not be used to endorse or promote
+%%%   products derived from this software without specific prior written
+%%%   permission.
+%%%
+%%% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+%%% "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+%%% LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+%%% A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+%%% OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+%%% SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+%%% LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+%%% DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+%%% THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+%%% (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+%%% OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+%%%============================================================================
+%%%============================================================================
+%%% @doc
+%%% Open loop load generator paced by a timerfd.
+%%%
+%%% Requests arrive at absolute times drawn from a constant rate, a Poisson
+%%% process or a replayed trace, independently of how fast they are served.
+%%% The coordinator arms a single timer at the next arrival, and on every
+%%% wakeup hands all arrivals due by then, as one batch, to idle workers or
+%%% a backlog. Workers stamp the time they actually send, so latency is
+%%% measured from the intended arrival. Time spent waiting behind a late
+%%% wakeup or a busy worker counts against the system rather than being
+%%% silently omitted, as it is with closed loop workers pacing themselves
+%%% with timer:sleep/1.
+%%% @end
+%%% ===========================================================================
+-module(timerfd_loadgen).
+
+%% API exports
+-export([
+         run/2
+        ]).
+
+-type arrivals() :: {constant, PerSecond :: number()}
+                  | {poisson, PerSecond :: number()}
+                  | {trace, {profile, timerfd_replay:profile()}
+                           | file:filename()}.
+-type option() :: {arrivals, arrivals()}
+                | {count, pos_integer()}
+                | {duration, Milliseconds :: pos_integer()}
+                | {workers, pos_integer()}
+                | {slack, Microseconds :: non_neg_integer()}
+                | {lead, Microseconds :: non_neg_integer()}.
+-type summary() :: [{min | mean | p50 | p90 | p99 | p999 | max,
+                     Microseconds :: number()}].
+-type result() :: {requests, non_neg_integer()}
+                | {errors, non_neg_integer()}
+                | {batches, non_neg_integer()}
+                | {max_batch, non_neg_integer()}
+                | {latency, summary()}
+                | {service_time, summary()}
+                | {send_lag, summary()}.
+
+-export_type([arrivals/0]).
+
+-define(DEFAULT_WORKERS, 8).
+-define(DEFAULT_SLACK, 0).
+%% Microseconds to the first arrival, so it is not already late
+-define(DEFAULT_LEAD, 200).
+
+-record(state, {timer,
+                offset,         % timer clock minus Erlang monotonic time
+                start,
+                arrivals,
+                next,           % intended time of the next arrival or done
+                slack,
+                issued = 0,
+                count,
+                duration,
+                idle,
+                busy = 0,
+                backlog = queue:new(),
+                batches = 0,
+                max_batch = 0,
+                errors = 0,
+                latency = [],
+                service = [],
+                lag = []}).
+
+%%=============================================================================
+%% API functions
+%%=============================================================================
+
+-spec run(Request, Options) -> {ok, [result()]} | {error, Reason} when
+      Request :: fun(() -> term()),
+      Options :: [option()],
+      Reason :: term().
+%% @doc Calls Request at the arrival times given by Options and returns
+%% once every request has completed.
+%%
+%% `{arrivals, Arrivals}' is required. `{constant, Rate}' and
+%% `{poisson, Rate}' issue Rate requests per second on average, the latter
+%% with exponentially distributed gaps. `{trace, {profile, Gaps}}' takes
+%% the gaps in nanoseconds, `{trace, File}' reads them from a file in the
+%% format of timerfd_replay:load/1.
+%% Constant and Poisson arrivals must be bounded by `{count, N}' or
+%% `{duration, Milliseconds}', traces end with the trace.
+%%
+%% `{workers, N}' sets the number of worker processes, 8 by default.
+%% `{slack, Microseconds}' also dispatches arrivals due within
+%% Microseconds of a wakeup, trading early sends for fewer wakeups.
+%% `{lead, Microseconds}' delays the first arrival so that it is not late
+%% before the run has started, 200 by default.
+%%
+%% The results summarize in microseconds the latency from intended arrival
+%% to completion, the service time from send to completion and the send
+%% lag from intended arrival to send. A request that raises is counted as
+%% an error and still measured.
+%% @see timerfd_replay:load/1
+
+run(Request, Options) when is_function(Request, 0), is_list(Options) ->
+    Count = proplists:get_value(count, Options),
+    Duration = proplists:get_value(duration, Options),
+    case arrivals(proplists:get_value(arrivals, Options)) of
+        {ok, {trace, _, _}} = {ok, Arrivals} ->
+            spawn_run(Request, Arrivals, Count, Duration, Options);
+        {ok, _} when Count =:= undefined, Duration =:= undefined ->
+            {error, unbounded};
+        {ok, Arrivals} ->
+            spawn_run(Request, Arrivals, Count, Duration, Options);
+        Error ->
+            Error
+    end.
+
+%%=============================================================================
+%% Internal functions
+%%=============================================================================
+
+arrivals({constant, Rate}) when is_number(Rate), Rate > 0 ->
+    {ok, {constant, 1.0e9 / Rate, 0}};
+arrivals({poisson, Rate}) when is_number(Rate), Rate > 0 ->
+    {ok, {poisson, 1.0e9 / Rate, 0.0}};
+arrivals({trace, {profile, []}}) ->
+    {error, empty};
+arrivals({trace, {profile, Profile}}) when is_list(Profile) ->
+    {ok, {trace, Profile, 0}};
+arrivals({trace, File}) ->
+    case timerfd_replay:load(File) of
+        {ok, Profile} -> arrivals({trace, {profile, Profile}});
+        Error -> Error
+    end;
+arrivals(_) ->
+    {error, badarg}.
+
+%% Offset in nanoseconds from the start of the run of the next arrival
+next_arrival({constant, Period, N}) ->
+    {round(N * Period), {constant, Period, N + 1}};
+next_arrival({poisson, Mean, T}) ->
+    Next = T - Mean * math:log(rand:uniform_real()),
+    {round(Next), {poisson, Mean, Next}};
+next_arrival({trace, [Interval | Intervals], T}) ->
+    {T + Interval, {trace, Intervals, T + Interval}};
+next_arrival({trace, [], _}) ->
+    done.
+
+spawn_run(Request, Arrivals, Count, Duration, Options) ->
+    Parent = self(),
+    {Pid, MRef} =
+        spawn_monitor(fun() ->
+                              Parent ! {self(), init(Request, Arrivals,
+                                                     Count, Duration,
+                                                     Options)}
+                      end),
+    receive
+        {Pid, Result} ->
+            demonitor(MRef, [flush]),
+            Result;
+        {'DOWN', MRef, _, _, Reason} ->
+            {error, Reason}
+    end.
+
+init(Request, Arrivals, Count, Duration, Options) ->
+    Workers = proplists:get_value(workers, Options, ?DEFAULT_WORKERS),
+    Slack = proplists:get_value(slack, Options, ?DEFAULT_SLACK),
+    Lead = proplists:get_value(lead, Options, ?DEFAULT_LEAD),
+    {ok, Timer} = timerfd:create(clock_monotonic),
+    Idle = [spawn_link(fun() -> worker(Request) end)
+            || _ <- lists:seq(1, Workers)],
+    State = #state{timer = Timer,
+                   offset = clock_offset(Timer),
+                   start = erlang:monotonic_time(nanosecond) + Lead * 1000,
+                   arrivals = Arrivals,
+                   slack = Slack * 1000,
+                   count = Count,
+                   duration = case Duration of
+                                  undefined -> undefined;
+                                  _ -> Duration * 1000000
+                              end,
+                   idle = Idle},
+    Result = loop(arm(advance(State))),
+    ok = timerfd:close(Timer),
+    [Worker ! stop || Worker <- Idle],
+    {ok, Result}.
+
+%% The timer clock and Erlang monotonic time tick at the same rate but from
+%% different origins, sample the clock between two readings of Erlang time
+clock_offset(Timer) ->
+    Before = erlang:monotonic_time(nanosecond),
+    {ok, Clock} = timerfd:clock_time(Timer),
+    After = erlang:monotonic_time(nanosecond),
+    Clock - (Before + After) div 2.
+
+%% Draw the next arrival unless the run is over
+advance(State = #state{issued = Count, count = Count}) ->
+    State#state{next = done};
+advance(State = #state{start = Start, arrivals = Arrivals,
+                       duration = Duration, issued = Issued}) ->
+    case next_arrival(Arrivals) of
+        {Offset, _} when Duration =/= undefined, Offset > Duration ->
+            State#state{next = done};
+        {Offset, Next} ->
+            State#state{next = Start + Offset, arrivals = Next,
+                        issued = Issued + 1};
+        done ->
+            State#state{next = done}
+    end.
+
+arm(State = #state{next = done}) ->
+    State;
+arm(State = #state{timer = Timer, next = Next, offset = Offset}) ->
+    Deadline = Next + Offset,
+    {ok, _} = timerfd:set_time(Timer, {{0, 0}, {Deadline div 1000000000,
+                                                Deadline rem 1000000000}},
+                               true),
+    State.
+
+loop(State = #state{next = done, busy = 0}) ->
+    case queue:is_empty(State#state.backlog) of
+        true -> results(State);
+        false -> loop(assign(State))
+    end;
+loop(State = #state{timer = Timer}) ->
+    receive
+        {Timer, {data, _}} ->
+            {ok, _} = timerfd:read(Timer),
+            loop(arm(assign(due(State, 0))));
+        {Worker, done, Intended, Sent, Done, Status} ->
+            loop(assign(finished(State, Worker, Intended, Sent, Done,
+                                 Status)))
+    end.
+
+%% Move every arrival due by now into the backlog as one batch
+due(State = #state{next = done}, Batch) ->
+    batch(State, Batch);
+due(State = #state{next = Next, slack = Slack, backlog = Backlog}, Batch) ->
+    case Next =< erlang:monotonic_time(nanosecond) + Slack of
+        true ->
+            due(advance(State#state{backlog = queue:in(Next, Backlog)}),
+                Batch + 1);
+        false ->
+            batch(State, Batch)
+    end.
+
+batch(State, 0) ->
+    State;
+batch(State = #state{batches = Batches, max_batch = Max}, Batch) ->
+    State#state{batches = Batches + 1, max_batch = max(Max, Batch)}.
+
+assign(State = #state{idle = [Worker | Idle], busy = Busy,
+                      backlog = Backlog}) ->
+    case queue:out(Backlog) of
+        {{value, Intended}, Rest} ->
+            Worker ! {self(), request, Intended},
+            assign(State#state{idle = Idle, busy = Busy + 1,
+                               backlog = Rest});
+        {empty, _} ->
+            State
+    end;
+assign(State) ->
+    State.
+
+finished(State = #state{idle = Idle, busy = Busy, errors = Errors,
+                        latency = Latency, service = Service, lag = Lag},
+         Worker, Intended, Sent, Done, Status) ->
+    State#state{idle = [Worker | Idle],
+                busy = Busy - 1,
+                errors = case Status of
+                             ok -> Errors;
+                             error -> Errors + 1
+                         end,
+                latency = [Done - Intended | Latency],
+                service = [Done - Sent | Service],
+                lag = [Sent - Intended | Lag]}.
+
+results(#state{latency = Latency, service = Service, lag = Lag,
+               errors = Errors, batches = Batches, max_batch = Max}) ->
+    [{requests, length(Latency)},
+     {errors, Errors},
+     {batches, Batches},
+     {max_batch, Max},
+     {latency, summary(Latency)},
+     {service_time, summary(Service)},
+     {send_lag, summary(Lag)}].
+
+summary([]) ->
+    [];
+summary(Samples) ->
+    Sorted = list_to_tuple(lists:sort(Samples)),
+    N = tuple_size(Sorted),
+    Percentile = fun(P) ->
+                         element(max(1, ceil(P * N)), Sorted) / 1000
+                 end,
+    [{min, element(1, Sorted) / 1000},
+     {mean, lists:sum(Samples) / N / 1000},
+     {p50, Percentile(0.5)},
+     {p90, Percentile(0.9)},
+     {p99, Percentile(0.99)},
+     {p999, Percentile(0.999)},
+     {max, element(N, Sorted) / 1000}].
+
+worker(Request) ->
+    receive
+        {Coordinator, request, Intended} ->
+            Sent = erlang:monotonic_time(nanosecond),
+            Status = try Request() of
+                         _ -> ok
+                     catch
+                         _:_ -> error
+                     end,
+            Done = erlang:monotonic_time(nanosecond),
+            Coordinator ! {self(), done, Intended, Sent, Done, Status},
+            worker(Request);
+        stop ->
+            ok
+    end.
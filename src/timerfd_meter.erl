@@ -0,0 +1,223 @@
+%%%============================================================================
+%%% Copyright (c) 2016, Mark Jones <markalanj@gmail.com>.
+%%% All rights reserved.
+%%%
+%%% Redistribution and use in source and binary forms, with or without
+%%% modification, are permitted provided that the following conditions are
+%%% met:
+%%%
+%%% * Redistributions of source code must retain the above copyright
+%%%   notice, this list of conditions and the following disclaimer.
+%%%
+%%% * Redistributions in binary form must reproduce the above copyright
+%%%   notice, this list of conditions and the following disclaimer in the
+%%%   documentation and/or other materials provided with the distribution.
+%%%
+%%% * The names of its contributors may not be used to endorse or promote
+%%%   products derived from this software without specific prior written
+%%%   permission.
+%%%
+%%% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+%%% "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+%%% LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+%%% A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+%%% OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+%%% SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+%%% LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+%%% DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+%%% THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+%%% (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+%%% OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+%%%============================================================================
+
+%%%============================================================================
+%%% @doc
+%%% Sliding window rate meter on top of a timerfd.
+%%%
+%%% Events are counted into a ring of buckets held in an atomics array. A
+%%% process owning a timerfd moves to the next bucket every resolution
+%%% microseconds, keeping the sum and the peak of the completed buckets and
+%%% a running total per tick up to date. mark/2, rate/1 and peak/1 only touch the atomics array and
+%%% never message the meter process. Rates are in events per second.
+%%% @end
+%%% ===========================================================================
+-module(timerfd_meter).
+
+%% API exports
+-export([
+         start_link/1,
+         stop/1,
+         mark/1,
+         mark/2,
+         rate/1,
+         rate/2,
+         peak/1
+        ]).
+
+%% proc_lib callback
+-export([init/4]).
+
+-type meter() :: {?MODULE, pid(), atomics:atomics_ref(),
+                  Buckets :: pos_integer(), Resolution :: pos_integer()}.
+-type option() :: {resolution, pos_integer()} | {buckets, pos_integer()}.
+
+-export_type([meter/0]).
+
+-define(DEFAULT_RESOLUTION, 100).
+-define(DEFAULT_BUCKETS, 10000).
+
+%% Atomics layout, buckets follow and then the running totals. There is one
+%% more running total than buckets so the oldest one a reader may need is
+%% not overwritten while it reads.
+-define(TICK, 1).
+-define(TOTAL, 2).
+-define(PEAK, 3).
+-define(BUCKET(Tick, Buckets), (4 + (Tick) rem (Buckets))).
+-define(CUMULATIVE(Tick, Buckets), (4 + (Buckets) + (Tick) rem ((Buckets) + 1))).
+
+%%=============================================================================
+%% API functions
+%%=============================================================================
+
+-spec start_link(Options) -> {ok, meter()} | {error, Reason} when
+      Options :: [option()],
+      Reason :: term().
+%% @doc Starts a meter. The resolution option is the bucket width in
+%% microseconds and buckets the ring size, one of which is always the bucket
+%% being filled. The default is one second of 100 microsecond buckets.
+
+start_link(Options) ->
+    Resolution = proplists:get_value(resolution, Options, ?DEFAULT_RESOLUTION),
+    Buckets = proplists:get_value(buckets, Options, ?DEFAULT_BUCKETS) + 1,
+    Counts = atomics:new(4 + 2 * Buckets, [{signed, false}]),
+    proc_lib:start_link(?MODULE, init, [self(), Resolution, Buckets, Counts]).
+
+-spec stop(Meter) -> ok when
+      Meter :: meter().
+%% @doc Stops the meter and closes its timer.
+
+stop({?MODULE, Pid, _, _, _}) ->
+    MRef = monitor(process, Pid),
+    Pid ! {?MODULE, stop},
+    receive
+        {'DOWN', MRef, _, _, _} -> ok
+    end.
+
+-spec mark(Meter) -> ok when
+      Meter :: meter().
+%% @equiv mark(Meter, 1)
+
+mark(Meter) ->
+    mark(Meter, 1).
+
+-spec mark(Meter, N) -> ok when
+      Meter :: meter(),
+      N :: non_neg_integer().
+%% @doc Counts N events in the current bucket.
+
+mark({?MODULE, _, Counts, Buckets, _}, N) ->
+    atomics:add(Counts, ?BUCKET(atomics:get(Counts, ?TICK), Buckets), N).
+
+-spec rate(Meter) -> float() when
+      Meter :: meter().
+%% @doc Returns the rate over all completed buckets.
+
+rate({?MODULE, _, Counts, Buckets, Resolution}) ->
+    atomics:get(Counts, ?TOTAL) * 1.0e6 / ((Buckets - 1) * Resolution).
+
+-spec rate(Meter, Window) -> float() when
+      Meter :: meter(),
+      Window :: pos_integer().
+%% @doc Returns the rate over the most recent completed buckets covering
+%% Window microseconds. It takes the difference of two running totals, so
+%% the cost does not depend on the window.
+
+rate({?MODULE, _, Counts, Buckets, Resolution}, Window) ->
+    Width = max(1, min(Window div Resolution, Buckets - 1)),
+    Last = atomics:get(Counts, ?TICK) - 1,
+    (cumulative(Counts, Buckets, Last)
+     - cumulative(Counts, Buckets, Last - Width))
+        * 1.0e6 / (Width * Resolution).
+
+-spec peak(Meter) -> float() when
+      Meter :: meter().
+%% @doc Returns the highest single bucket rate among the completed buckets.
+
+peak({?MODULE, _, Counts, _, Resolution}) ->
+    atomics:get(Counts, ?PEAK) * 1.0e6 / Resolution.
+
+%%=============================================================================
+%% Internal functions
+%%=============================================================================
+
+%% Events counted in the buckets completed up to and including Tick
+cumulative(_, _, Tick) when Tick < 0 ->
+    0;
+cumulative(Counts, Buckets, Tick) ->
+    atomics:get(Counts, ?CUMULATIVE(Tick, Buckets)).
+
+init(Parent, Resolution, Buckets, Counts) ->
+    {ok, Timer} = timerfd:create(clock_monotonic),
+    {ok, _} = timerfd:set_interval(Timer, Resolution),
+    proc_lib:init_ack(Parent, {ok, {?MODULE, self(), Counts, Buckets,
+                                    Resolution}}),
+    loop(#{timer => Timer,
+           counts => Counts,
+           %% Value each bucket added to the total when it was completed
+           counted => atomics:new(Buckets, [{signed, false}]),
+           buckets => Buckets,
+           %% Completed buckets that may still become the peak, as
+           %% {Tick, Count} with decreasing counts
+           peaks => queue:new()}).
+
+loop(State = #{timer := Timer}) ->
+    receive
+        {Timer, {data, _}} ->
+            {ok, Expirations} = timerfd:read(Timer),
+            loop(rotate(min(Expirations, maps:get(buckets, State)), State));
+        {?MODULE, stop} ->
+            ok = timerfd:close(Timer)
+    end.
+
+rotate(0, State) ->
+    State;
+rotate(N, State = #{counts := Counts, counted := Counted,
+                     buckets := Buckets, peaks := Peaks}) ->
+    Tick = atomics:get(Counts, ?TICK),
+    Next = Tick + 1,
+    Before = cumulative(Counts, Buckets, Tick - 1),
+    %% Readers see the running total of Tick as soon as it is completed,
+    %% then it is topped up with the marks that raced the rotation
+    atomics:put(Counts, ?CUMULATIVE(Tick, Buckets),
+                Before + atomics:get(Counts, ?BUCKET(Tick, Buckets))),
+    atomics:put(Counts, ?BUCKET(Next, Buckets), 0),
+    atomics:put(Counts, ?TICK, Next),
+    %% Marks may still land in the completed bucket, so the total is
+    %% corrected with what was counted rather than what is evicted.
+    Completed = atomics:get(Counts, ?BUCKET(Tick, Buckets)),
+    Evicted = atomics:exchange(Counted, 1 + Next rem Buckets, 0),
+    atomics:put(Counted, 1 + Tick rem Buckets, Completed),
+    atomics:add(Counts, ?TOTAL, Completed),
+    atomics:sub(Counts, ?TOTAL, Evicted),
+    atomics:put(Counts, ?CUMULATIVE(Tick, Buckets), Before + Completed),
+    NewPeaks = expire_peaks(Next - Buckets + 1,
+                            push_peak({Tick, Completed}, Peaks)),
+    {value, {_, Peak}} = queue:peek(NewPeaks),
+    atomics:put(Counts, ?PEAK, Peak),
+    rotate(N - 1, State#{peaks := NewPeaks}).
+
+push_peak(Peak = {_, Count}, Peaks) ->
+    case queue:peek_r(Peaks) of
+        {value, {_, Smaller}} when Smaller =< Count ->
+            push_peak(Peak, queue:drop_r(Peaks));
+        _ ->
+            queue:in(Peak, Peaks)
+    end.
+
+expire_peaks(Oldest, Peaks) ->
+    case queue:peek(Peaks) of
+        {value, {Tick, _}} when Tick < Oldest ->
+            expire_peaks(Oldest, queue:drop(Peaks));
+        _ ->
+            Peaks
+    end.
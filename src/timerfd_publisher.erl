@@ -0,0 +1,154 @@
+%%%============================================================================
+%%% Copyright (c) 2016, Mark Jones <markalanj@gmail.com>.
+%%% All rights reserved.
+%%%
+%%% Redistribution and use in source and binary forms, with or without
+%%% modification, are permitted provided that the following conditions are
+%%% met:
+%%%
+%%% * Redistributions of source code must retain the above copyright
+%%%   notice, this list of conditions and the following disclaimer.
+%%%
+%%% * Redistributions in binary form must reproduce the above copyright
+%%%   notice, this list of conditions and the following disclaimer in the
+%%%   documentation and/or other materials provided with the distribution.
+%%%
+%%% * The names of its contributors may not be used to endorse or promote
+%%%   products derived from this software without specific prior written
+%%%   permission.
+%%%
+%%% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+%%% "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+%%% LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+%%% A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+%%% OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+%%% SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+%%% LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+%%% DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+%%% THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+%%% (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+%%% OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+%%%============================================================================
+
+%%%============================================================================
+%%% @doc
+%%% Tick synchronous publication of a shared state snapshot.
+%%%
+%%% Writers encode a complete snapshot into the back buffer with update/2.
+%%% At every expiration of the publisher's timerfd the latest back buffer,
+%%% if any, becomes the published front buffer. Both buffers are single ETS
+%%% objects holding a refc binary, so swapping them is atomic, readers never
+%%% see a torn snapshot and reading copies a reference rather than the
+%%% snapshot. Neither writers nor readers message the publisher process.
+%%% @end
+%%% ===========================================================================
+-module(timerfd_publisher).
+
+%% API exports
+-export([
+         start_link/1,
+         stop/1,
+         update/2,
+         read/1,
+         read_binary/1
+        ]).
+
+%% proc_lib callback
+-export([init/2]).
+
+-type publisher() :: {?MODULE, pid(), ets:tid()}.
+-type option() :: {interval, pos_integer()}.
+
+-export_type([publisher/0]).
+
+-define(DEFAULT_INTERVAL, 1000).
+
+%%=============================================================================
+%% API functions
+%%=============================================================================
+
+-spec start_link(Options) -> {ok, publisher()} | {error, Reason} when
+      Options :: [option()],
+      Reason :: term().
+%% @doc Starts a publisher flipping buffers every interval microseconds.
+
+start_link(Options) ->
+    Interval = proplists:get_value(interval, Options, ?DEFAULT_INTERVAL),
+    proc_lib:start_link(?MODULE, init, [self(), Interval]).
+
+-spec stop(Publisher) -> ok when
+      Publisher :: publisher().
+%% @doc Stops the publisher. The buffers go away with it.
+
+stop({?MODULE, Pid, _}) ->
+    MRef = monitor(process, Pid),
+    Pid ! {?MODULE, stop},
+    receive
+        {'DOWN', MRef, _, _, _} -> ok
+    end.
+
+-spec update(Publisher, State) -> ok when
+      Publisher :: publisher(),
+      State :: term().
+%% @doc Replaces the back buffer with State, which is published at the next
+%% tick unless replaced again before. State is always a whole snapshot.
+
+update({?MODULE, _, Tab}, State) ->
+    true = ets:insert(Tab, {back, term_to_binary(State)}),
+    ok.
+
+-spec read(Publisher) -> {ok, Frame, State} | {error, empty} when
+      Publisher :: publisher(),
+      Frame :: pos_integer(),
+      State :: term().
+%% @doc Returns the published snapshot and the tick it was published at.
+
+read(Publisher) ->
+    case read_binary(Publisher) of
+        {ok, Frame, Binary} -> {ok, Frame, binary_to_term(Binary)};
+        Error -> Error
+    end.
+
+-spec read_binary(Publisher) -> {ok, Frame, Binary} | {error, empty} when
+      Publisher :: publisher(),
+      Frame :: pos_integer(),
+      Binary :: binary().
+%% @doc Like read/1 but returns the snapshot in external term format, for
+%% readers that only pass it on or decode it lazily.
+
+read_binary({?MODULE, _, Tab}) ->
+    case ets:lookup(Tab, front) of
+        [{front, Frame, Binary}] -> {ok, Frame, Binary};
+        [] -> {error, empty}
+    end.
+
+%%=============================================================================
+%% Internal functions
+%%=============================================================================
+
+init(Parent, Interval) ->
+    Tab = ets:new(?MODULE, [set, public, {read_concurrency, true},
+                            {write_concurrency, true}]),
+    {ok, Timer} = timerfd:create(clock_monotonic),
+    {ok, _} = timerfd:set_interval(Timer, Interval),
+    proc_lib:init_ack(Parent, {ok, {?MODULE, self(), Tab}}),
+    loop(Timer, Tab, 0).
+
+loop(Timer, Tab, Frame) ->
+    receive
+        {Timer, {data, _}} ->
+            {ok, Expirations} = timerfd:read(Timer),
+            NextFrame = Frame + Expirations,
+            flip(Tab, NextFrame),
+            loop(Timer, Tab, NextFrame);
+        {?MODULE, stop} ->
+            ok = timerfd:close(Timer)
+    end.
+
+%% A writer updating the back buffer after the take is published at the
+%% next tick
+flip(Tab, Frame) ->
+    case ets:take(Tab, back) of
+        [{back, Binary}] -> true = ets:insert(Tab, {front, Frame, Binary});
+        [] -> true
+    end.
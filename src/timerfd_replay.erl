@@ -0,0 +1,109 @@
+%%%============================================================================
+%%% Copyright (c) 2016, Mark Jones <markalanj@gmail.com>.
+%%% All rights reserved.
+%%%
+%%% Redistribution and use in source and binary forms, with or without
+%%% modification, are permitted provided that the following conditions are
+%%% met:
+%%%
+%%% * Redistributions of source code must retain the above copyright
+%%%   notice, this list of conditions and the following disclaimer.
+%%%
+%%% * Redistributions in binary form must reproduce the above copyright
+%%%   notice, this list of conditions and the following disclaimer in the
+%%%   documentation and/or other materials provided with the distribution.
+%%%
+%%% * The names of its contributors may not be used to endorse or promote
+%%%   products derived from this software without specific prior written
+%%%   permission.
+%%%
+%%% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+%%% "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+%%% LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+%%% A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+%%% OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+%%% SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+%%% LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+%%% DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+%%% THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+%%% (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+%%% OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+%%%============================================================================
+
+%%%============================================================================
+%%% @doc
+%%% Replays captured tick timing through a timer.
+%%%
+%%% A profile is a sequence of intervals between ticks. Profiles are loaded
+%%% from text files holding one interval in microseconds per line, such as
+%%% the `plot/data.dat' file timerfd_bench writes. Fractional values are
+%%% allowed so traces captured with better than microsecond resolution
+%%% replay exactly. The consumer owning the timer receives ready messages
+%%% as usual.
+%%% @end
+%%% ===========================================================================
+-module(timerfd_replay).
+
+%% API exports
+-export([
+         load/1,
+         replay/3
+        ]).
+
+-type profile() :: [non_neg_integer()].
+
+-export_type([profile/0]).
+
+%%=============================================================================
+%% API functions
+%%=============================================================================
+
+-spec load(File) -> {ok, profile()} | {error, Reason} when
+      File :: file:filename(),
+      Reason :: term().
+%% @doc Loads a profile file and returns its intervals in nanoseconds.
+
+load(File) ->
+    case file:read_file(File) of
+        {ok, Binary} ->
+            try
+                {ok, [to_nanoseconds(Line)
+                      || Line <- binary:split(Binary, [<<"\n">>, <<"\r">>],
+                                              [global, trim_all])]}
+            catch
+                error:badarg -> {error, badarg}
+            end;
+        Error ->
+            Error
+    end.
+
+-spec replay(Timer, Profile, Loop) -> ok | {error, Reason} when
+      Timer :: timerfd:timer(),
+      Profile :: {profile, profile()} | file:filename(),
+      Loop :: boolean(),
+      Reason :: term().
+%% @doc Arms Timer to tick with the intervals of Profile, given either as
+%% `{profile, Nanoseconds}' or as a profile file, repeating it when Loop is
+%% true.
+%% @see timerfd:set_schedule/3
+
+replay(Timer, {profile, Profile}, Loop) ->
+    timerfd:set_schedule(Timer, Profile, Loop);
+replay(Timer, File, Loop) ->
+    case load(File) of
+        {ok, []} -> {error, empty};
+        {ok, Profile} -> replay(Timer, {profile, Profile}, Loop);
+        Error -> Error
+    end.
+
+%%=============================================================================
+%% Internal functions
+%%=============================================================================
+
+to_nanoseconds(Line) ->
+    Trimmed = string:trim(Line),
+    try binary_to_integer(Trimmed) of
+        Microseconds -> Microseconds * 1000
+    catch
+        error:badarg -> round(binary_to_float(Trimmed) * 1000)
+    end.
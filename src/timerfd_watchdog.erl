@@ -0,0 +1,237 @@
+%%%============================================================================
+%%% Copyright (c) 2016, Mark Jones <markalanj@gmail.com>.
+%%% All rights reserved.
+%%%
+%%% Redistribution and use in source and binary forms, with or without
+%%% modification, are permitted provided that the following conditions are
+%%% met:
+%%%
+%%% * Redistributions of source code must retain the above copyright
+%%%   notice, this list of conditions and the following disclaimer.
+%%%
+%%% * Redistributions in binary form must reproduce the above copyright
+%%%   notice, this list of conditions and the following disclaimer in the
+%%%   documentation and/or other materials provided with the distribution.
+%%%
+%%% * The names of its contributors may not be used to endorse or promote
+%%%   products derived from this software without specific prior written
+%%%   permission.
+%%%
+%%% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+%%% "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+%%% LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+%%% A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+%%% OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+%%% SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+%%% LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+%%% DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+%%% THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+%%% (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+%%% OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+%%%============================================================================
+
+%%%============================================================================
+%%% @doc
+%%% High resolution process watchdog on top of a timerfd.
+%%%
+%%% Watched processes kick their watchdog with kick/1, which is a single
+%%% atomics store and sends no message. The watchdog keeps the watches
+%%% ordered by deadline, each time its timer expires it reads the kicks of
+%%% the watches that are due, and sends
+%%% `{timerfd_watchdog, WatchRef, Pid, late, LateBy}' to the supervisor as
+%%% soon as a process has not kicked within its timeout. LateBy is in
+%%% microseconds. The supervisor is told once per missed deadline; the next
+%%% kick re-arms the watch.
+%%% @end
+%%% ===========================================================================
+-module(timerfd_watchdog).
+
+%% API exports
+-export([
+         start_link/2,
+         stop/1,
+         watch/3,
+         unwatch/1,
+         kick/1
+        ]).
+
+%% proc_lib callback
+-export([init/5]).
+
+-type watchdog() :: {?MODULE, pid(), atomics:atomics_ref()}.
+-type watch_ref() :: {?MODULE, pid(), atomics:atomics_ref(), pos_integer()}.
+-type option() :: {resolution, pos_integer()} | {capacity, pos_integer()}.
+
+-export_type([watchdog/0, watch_ref/0]).
+
+-define(DEFAULT_RESOLUTION, 1000).
+-define(DEFAULT_CAPACITY, 4096).
+
+%%=============================================================================
+%% API functions
+%%=============================================================================
+
+-spec start_link(Supervisor, Options) -> {ok, watchdog()}
+                                             | {error, Reason} when
+      Supervisor :: pid(),
+      Options :: [option()],
+      Reason :: term().
+%% @doc Starts a watchdog reporting to Supervisor. The resolution option is
+%% the check interval in microseconds, capacity the maximum number of
+%% processes watched at once.
+
+start_link(Supervisor, Options) ->
+    Resolution = proplists:get_value(resolution, Options, ?DEFAULT_RESOLUTION),
+    Capacity = proplists:get_value(capacity, Options, ?DEFAULT_CAPACITY),
+    Kicks = atomics:new(Capacity, [{signed, true}]),
+    proc_lib:start_link(?MODULE, init, [self(), Supervisor, Resolution,
+                                        Capacity, Kicks]).
+
+-spec stop(Watchdog) -> ok when
+      Watchdog :: watchdog().
+%% @doc Stops the watchdog and closes its timer.
+
+stop({?MODULE, Pid, _}) ->
+    call(Pid, stop).
+
+-spec watch(Watchdog, Pid, Timeout) -> {ok, watch_ref()} | {error, full} when
+      Watchdog :: watchdog(),
+      Pid :: pid(),
+      Timeout :: pos_integer().
+%% @doc Starts watching Pid, which must kick the returned reference at
+%% least every Timeout microseconds. The watch counts as kicked when it is
+%% created and ends when Pid exits.
+
+watch({?MODULE, WatchdogPid, Kicks}, Pid, Timeout)
+  when is_pid(Pid), is_integer(Timeout), Timeout > 0 ->
+    case call(WatchdogPid, {watch, Pid, Timeout}) of
+        {ok, Ix} -> {ok, {?MODULE, WatchdogPid, Kicks, Ix}};
+        Other -> Other
+    end.
+
+-spec unwatch(WatchRef) -> ok when
+      WatchRef :: watch_ref().
+%% @doc Stops watching. The reference must not be kicked afterwards.
+
+unwatch({?MODULE, WatchdogPid, _, Ix}) ->
+    call(WatchdogPid, {unwatch, Ix}).
+
+-spec kick(WatchRef) -> ok when
+      WatchRef :: watch_ref().
+%% @doc Tells the watchdog the watched process is alive.
+
+kick({?MODULE, _, Kicks, Ix}) ->
+    atomics:put(Kicks, Ix, erlang:monotonic_time(micro_seconds)).
+
+%%=============================================================================
+%% Internal functions
+%%=============================================================================
+
+call(Pid, Request) ->
+    MRef = monitor(process, Pid),
+    Pid ! {?MODULE, self(), MRef, Request},
+    receive
+        {MRef, Reply} ->
+            demonitor(MRef, [flush]),
+            Reply;
+        {'DOWN', MRef, _, _, Reason} ->
+            exit(Reason)
+    end.
+
+init(Parent, Supervisor, Resolution, Capacity, Kicks) ->
+    {ok, Timer} = timerfd:create(clock_monotonic),
+    {ok, _} = timerfd:set_interval(Timer, Resolution),
+    proc_lib:init_ack(Parent, {ok, {?MODULE, self(), Kicks}}),
+    loop(#{timer => Timer,
+           supervisor => Supervisor,
+           kicks => Kicks,
+           free => lists:seq(1, Capacity),
+           %% Ix => {Pid, MonitorRef, Timeout, LastReportedKick, Due}
+           watches => #{},
+           %% {Due, Ix} of every watch, the next to check first
+           queue => gb_sets:new()}).
+
+loop(State = #{timer := Timer}) ->
+    receive
+        {Timer, {data, _}} ->
+            {ok, _} = timerfd:read(Timer),
+            loop(check(State));
+        {?MODULE, From, MRef, stop} ->
+            ok = timerfd:close(Timer),
+            From ! {MRef, ok};
+        {?MODULE, From, MRef, Request} ->
+            {Reply, NewState} = handle(Request, State),
+            From ! {MRef, Reply},
+            loop(NewState);
+        {'DOWN', _, process, Pid, _} ->
+            loop(remove_pid(Pid, State))
+    end.
+
+handle({watch, _, _}, State = #{free := []}) ->
+    {{error, full}, State};
+handle({watch, Pid, Timeout}, State = #{kicks := Kicks, free := [Ix | Free]}) ->
+    Now = erlang:monotonic_time(micro_seconds),
+    atomics:put(Kicks, Ix, Now),
+    MRef = monitor(process, Pid),
+    {{ok, Ix}, schedule(Ix, {Pid, MRef, Timeout, none}, Now + Timeout,
+                        State#{free := Free})};
+handle({unwatch, Ix}, State) ->
+    {ok, remove(Ix, State)}.
+
+schedule(Ix, {Pid, MRef, Timeout, Reported}, Due,
+         State = #{watches := Watches, queue := Queue}) ->
+    State#{watches := Watches#{Ix => {Pid, MRef, Timeout, Reported, Due}},
+           queue := gb_sets:add({Due, Ix}, Queue)}.
+
+remove(Ix, State = #{free := Free, watches := Watches, queue := Queue}) ->
+    case maps:take(Ix, Watches) of
+        {{_, MRef, _, _, Due}, NewWatches} ->
+            demonitor(MRef, [flush]),
+            State#{free := [Ix | Free], watches := NewWatches,
+                   queue := gb_sets:delete({Due, Ix}, Queue)};
+        error ->
+            State
+    end.
+
+remove_pid(Pid, State = #{watches := Watches}) ->
+    maps:fold(fun(Ix, {WatchedPid, _, _, _, _}, Acc) when WatchedPid == Pid ->
+                      remove(Ix, Acc);
+                 (_, _, Acc) ->
+                      Acc
+              end, State, Watches).
+
+%% Only the watches whose deadline has passed are looked at, so a tick costs
+%% as much as the number of watches due rather than the number watched
+check(State) ->
+    check(erlang:monotonic_time(micro_seconds), State).
+
+check(Now, State = #{queue := Queue}) ->
+    case gb_sets:is_empty(Queue) of
+        true ->
+            State;
+        false ->
+            case gb_sets:take_smallest(Queue) of
+                {{Due, Ix}, Rest} when Due < Now ->
+                    check(Now, check_watch(Now, Ix, State#{queue := Rest}));
+                _ ->
+                    State
+            end
+    end.
+
+%% A watch kicked in time is due again a timeout after its kick. A late one
+%% is reported once per missed kick and looked at again a timeout later.
+check_watch(Now, Ix, State = #{supervisor := Supervisor, kicks := Kicks,
+                               watches := Watches}) ->
+    {Pid, MRef, Timeout, Reported, _} = maps:get(Ix, Watches),
+    case atomics:get(Kicks, Ix) of
+        Kick when Kick + Timeout >= Now ->
+            schedule(Ix, {Pid, MRef, Timeout, Reported}, Kick + Timeout,
+                     State);
+        Reported ->
+            schedule(Ix, {Pid, MRef, Timeout, Reported}, Now + Timeout,
+                     State);
+        Kick ->
+            Supervisor ! {?MODULE, {?MODULE, self(), Kicks, Ix}, Pid, late,
+                          Now - Kick - Timeout},
+            schedule(Ix, {Pid, MRef, Timeout, Kick}, Now + Timeout, State)
+    end.
@@ -0,0 +1,85 @@
+%%%============================================================================
+%%% Copyright (c) 2016, Mark Jones <markalanj@gmail.com>.
+%%% All rights reserved.
+%%%
+%%% Redistribution and use in source and binary forms, with or without
+%%% modification, are permitted provided that the following conditions are
+%%% met:
+%%%
+%%% * Redistributions of source code must retain the above copyright
+%%%   notice, this list of conditions and the following disclaimer.
+%%%
+%%% * Redistributions in binary form must reproduce the above copyright
+%%%   notice, this list of conditions and the following disclaimer in the
+%%%   documentation and/or other materials provided with the distribution.
+%%%
+%%% * The names of its contributors may not be used to endorse or promote
+%%%   products derived from this software without specific prior written
+%%%   permission.
+%%%
+%%% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+%%% "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+%%% LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+%%% A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+%%% OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+%%% SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+%%% LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+%%% DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+%%% THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+%%% (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+%%% OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+%%%============================================================================
+
+-module(timerfd_loadgen_tests).
+
+-include_lib("eunit/include/eunit.hrl").
+
+constant_test() ->
+    {ok, Results} = timerfd_loadgen:run(fun() -> ok end,
+                                        [{arrivals, {constant, 1000}},
+                                         {count, 50},
+                                         {workers, 2}]),
+    ?assertEqual(50, proplists:get_value(requests, Results)),
+    ?assertEqual(0, proplists:get_value(errors, Results)),
+    ?assert(proplists:get_value(batches, Results) >= 1),
+    Latency = proplists:get_value(latency, Results),
+    ?assert(proplists:get_value(p50, Latency) =<
+                proplists:get_value(max, Latency)).
+
+poisson_test() ->
+    {ok, Results} = timerfd_loadgen:run(fun() -> error(failed) end,
+                                        [{arrivals, {poisson, 500}},
+                                         {duration, 50}]),
+    ?assertEqual(proplists:get_value(requests, Results),
+                 proplists:get_value(errors, Results)).
+
+%% Requests slower than the arrival rate queue up, and the wait counts
+trace_test() ->
+    {ok, Results} = timerfd_loadgen:run(fun() -> timer:sleep(20) end,
+                                        [{arrivals,
+                                          {trace, {profile, [1000000,
+                                                             1000000,
+                                                             1000000]}}},
+                                         {workers, 1}]),
+    ?assertEqual(3, proplists:get_value(requests, Results)),
+    Latency = proplists:get_value(latency, Results),
+    ?assert(proplists:get_value(max, Latency) > 40000).
+
+trace_file_test() ->
+    File = "timerfd_loadgen_test.dat",
+    ok = file:write_file(File, <<"1000\n2000\n1000\n500\n">>),
+    {ok, Results} = timerfd_loadgen:run(fun() -> ok end,
+                                        [{arrivals, {trace, File}}]),
+    ?assertEqual(4, proplists:get_value(requests, Results)),
+    ?assertEqual({error, enoent},
+                 timerfd_loadgen:run(fun() -> ok end,
+                                     [{arrivals,
+                                       {trace, "timerfd_loadgen_none.dat"}}])),
+    file:delete(File).
+
+unbounded_test() ->
+    ?assertEqual({error, unbounded},
+                 timerfd_loadgen:run(fun() -> ok end,
+                                     [{arrivals, {constant, 1000}}])),
+    ?assertEqual({error, badarg},
+                 timerfd_loadgen:run(fun() -> ok end, [{count, 1}])).
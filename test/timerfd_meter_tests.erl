@@ -0,0 +1,73 @@
+%%%============================================================================
+%%% Copyright (c) 2016, Mark Jones <markalanj@gmail.com>.
+%%% All rights reserved.
+%%%
+%%% Redistribution and use in source and binary forms, with or without
+%%% modification, are permitted provided that the following conditions are
+%%% met:
+%%%
+%%% * Redistributions of source code must retain the above copyright
+%%%   notice, this list of conditions and the following disclaimer.
+%%%
+%%% * Redistributions in binary form must reproduce the above copyright
+%%%   notice, this list of conditions and the following disclaimer in the
+%%%   documentation and/or other materials provided with the distribution.
+%%%
+%%% * The names of its contributors may not be used to endorse or promote
+%%%   products derived from this software without specific prior written
+%%%   permission.
+%%%
+%%% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+%%% "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+%%% LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+%%% A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+%%% OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+%%% SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+%%% LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+%%% DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+%%% THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+%%% (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+%%% OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+%%%============================================================================
+
+-module(timerfd_meter_tests).
+
+-include_lib("eunit/include/eunit.hrl").
+
+rate_test() ->
+    {ok, Meter} = timerfd_meter:start_link([{resolution, 1000},
+                                            {buckets, 100}]),
+    ?assertEqual(0.0, timerfd_meter:rate(Meter)),
+    lists:foreach(fun(_) ->
+                          ok = timerfd_meter:mark(Meter, 10),
+                          timer:sleep(1)
+                  end, lists:seq(1, 20)),
+    timer:sleep(5),
+    ?assert(timerfd_meter:rate(Meter) > 0),
+    ?assert(timerfd_meter:rate(Meter, 50000) > 0),
+    ?assert(timerfd_meter:peak(Meter) >= 10000.0),
+    ok = timerfd_meter:stop(Meter).
+
+window_test() ->
+    {ok, Meter} = timerfd_meter:start_link([{resolution, 1000},
+                                            {buckets, 10}]),
+    ok = timerfd_meter:mark(Meter, 5),
+    timer:sleep(30),
+    ?assertEqual(0.0, timerfd_meter:rate(Meter)),
+    ?assertEqual(0.0, timerfd_meter:peak(Meter)),
+    ok = timerfd_meter:stop(Meter).
+
+resolution_test() ->
+    {ok, Meter} = timerfd_meter:start_link([{resolution, 1000000},
+                                            {buckets, 2}]),
+    ok = timerfd_meter:mark(Meter),
+    ok = timerfd_meter:stop(Meter).
+
+window_rate_test() ->
+    {ok, Meter} = timerfd_meter:start_link([{resolution, 1000},
+                                            {buckets, 100}]),
+    ok = timerfd_meter:mark(Meter, 100),
+    timer:sleep(5),
+    %% 100 events over 50 ms
+    ?assertEqual(2000.0, timerfd_meter:rate(Meter, 50000)),
+    ok = timerfd_meter:stop(Meter).
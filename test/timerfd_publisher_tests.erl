@@ -0,0 +1,57 @@
+%%%============================================================================
+%%% Copyright (c) 2016, Mark Jones <markalanj@gmail.com>.
+%%% All rights reserved.
+%%%
+%%% Redistribution and use in source and binary forms, with or without
+%%% modification, are permitted provided that the following conditions are
+%%% met:
+%%%
+%%% * Redistributions of source code must retain the above copyright
+%%%   notice, this list of conditions and the following disclaimer.
+%%%
+%%% * Redistributions in binary form must reproduce the above copyright
+%%%   notice, this list of conditions and the following disclaimer in the
+%%%   documentation and/or other materials provided with the distribution.
+%%%
+%%% * The names of its contributors may not be used to endorse or promote
+%%%   products derived from this software without specific prior written
+%%%   permission.
+%%%
+%%% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+%%% "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+%%% LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+%%% A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+%%% OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+%%% SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+%%% LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+%%% DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+%%% THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+%%% (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+%%% OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+%%%============================================================================
+
+-module(timerfd_publisher_tests).
+
+-include_lib("eunit/include/eunit.hrl").
+
+publish_test() ->
+    {ok, Publisher} = timerfd_publisher:start_link([{interval, 1000}]),
+    ?assertEqual({error, empty}, timerfd_publisher:read(Publisher)),
+    ok = timerfd_publisher:update(Publisher, #{seq => 1}),
+    ok = timerfd_publisher:update(Publisher, #{seq => 2}),
+    timer:sleep(10),
+    {ok, Frame, State} = timerfd_publisher:read(Publisher),
+    ?assertEqual(#{seq => 2}, State),
+    timer:sleep(10),
+    ?assertMatch({ok, Frame, _}, timerfd_publisher:read_binary(Publisher)),
+    ok = timerfd_publisher:update(Publisher, #{seq => 3}),
+    timer:sleep(10),
+    {ok, NextFrame, #{seq := 3}} = timerfd_publisher:read(Publisher),
+    ?assert(NextFrame > Frame),
+    ok = timerfd_publisher:stop(Publisher).
+
+%% A 1 Hz publisher
+interval_test() ->
+    {ok, Publisher} = timerfd_publisher:start_link([{interval, 1000000}]),
+    ?assertEqual({error, empty}, timerfd_publisher:read(Publisher)),
+    ok = timerfd_publisher:stop(Publisher).
@@ -0,0 +1,92 @@
+%%%============================================================================
+%%% Copyright (c) 2016, Mark Jones <markalanj@gmail.com>.
+%%% All rights reserved.
+%%%
+%%% Redistribution and use in source and binary forms, with or without
+%%% modification, are permitted provided that the following conditions are
+%%% met:
+%%%
+%%% * Redistributions of source code must retain the above copyright
+%%%   notice, this list of conditions and the following disclaimer.
+%%%
+%%% * Redistributions in binary form must reproduce the above copyright
+%%%   notice, this list of conditions and the following disclaimer in the
+%%%   documentation and/or other materials provided with the distribution.
+%%%
+%%% * The names of its contributors may not be used to endorse or promote
+%%%   products derived from this software without specific prior written
+%%%   permission.
+%%%
+%%% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+%%% "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+%%% LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+%%% A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+%%% OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+%%% SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+%%% LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+%%% DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+%%% THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+%%% (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+%%% OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+%%%============================================================================
+
+-module(timerfd_replay_tests).
+
+-include_lib("eunit/include/eunit.hrl").
+
+load_test() ->
+    File = "timerfd_replay_test.dat",
+    ok = file:write_file(File, <<"333\n334\n\n332.5\n">>),
+    ?assertEqual({ok, [333000, 334000, 332500]}, timerfd_replay:load(File)),
+    ok = file:write_file(File, <<"333\nnotanumber\n">>),
+    ?assertEqual({error, badarg}, timerfd_replay:load(File)),
+    file:delete(File).
+
+replay_test() ->
+    File = "timerfd_replay_test.dat",
+    ok = file:write_file(File, <<"2000\n3000\n4000\n">>),
+    {ok, Timer} = timerfd:create(clock_monotonic),
+    ok = timerfd:setopts(Timer, [{priority, 0}]),
+    ?assertEqual(ok, timerfd_replay:replay(Timer, File, false)),
+    [D1, D2, D3] = [receive
+                        {Timer, {timerfd, ready, 0, Deadline}} ->
+                            {ok, 1} = timerfd:read(Timer),
+                            Deadline
+                    after
+                        1000 -> throw("timeout waiting for message")
+                    end || _ <- lists:seq(1, 3)],
+    ?assertEqual([3000000, 4000000], [D2 - D1, D3 - D2]),
+    ?assertEqual({error, enoent},
+                 timerfd_replay:replay(Timer, "timerfd_replay_none.dat",
+                                       false)),
+    ok = timerfd:close(Timer),
+    file:delete(File).
+
+replay_loop_test() ->
+    {ok, Timer} = timerfd:create(clock_monotonic),
+    ?assertEqual(ok, timerfd_replay:replay(Timer, {profile, [1000000]}, true)),
+    lists:foreach(fun(_) ->
+                          receive
+                              {Timer, {data, _}} ->
+                                  {ok, _} = timerfd:read(Timer)
+                          after
+                              1000 -> throw("timeout waiting for message")
+                          end
+                  end, lists:seq(1, 5)),
+    ok = timerfd:close(Timer).
+
+%% A consumer reading after the next deadline has passed must not stall the
+%% schedule
+replay_late_read_test() ->
+    {ok, Timer} = timerfd:create(clock_monotonic),
+    ok = timerfd_replay:replay(Timer, {profile, [1000000, 1000000]}, true),
+    lists:foreach(fun(_) ->
+                          receive
+                              {Timer, {data, _}} ->
+                                  timer:sleep(3),
+                                  {ok, _} = timerfd:read(Timer)
+                          after
+                              1000 -> throw("timeout waiting for message")
+                          end
+                  end, lists:seq(1, 5)),
+    ok = timerfd:close(Timer).
@@ -99,3 +99,233 @@ set_time_test() ->
     ?assertMatch({ok,{{_,_},{_,_}}}, timerfd:set_time(Timer, {0,0}, false)),
     ?assertMatch(ok, timerfd:close(Timer)).
 
+set_time_async_test() ->
+    {ok, Timer} = timerfd:create(clock_monotonic),
+    ?assertEqual(ok, timerfd:set_time_async(Timer, {{0,0},{0,1000000}}, false)),
+    ?assertEqual(ok, timerfd:set_time_async(Timer, {0,1000000}, false)),
+    receive
+        {Timer, {data, Data}} ->
+            ?assertEqual({timerfd,ready}, binary_to_term(Data))
+    after
+        1000 ->
+            throw("timeout waiting for message")
+    end,
+    {ok, Stats} = timerfd:stats(Timer),
+    ?assertEqual(2, proplists:get_value(async_requests, Stats)),
+    ?assert(proplists:get_value(async_batches, Stats) >= 1),
+    ?assertEqual(0, proplists:get_value(async_errors, Stats)),
+    ?assertMatch(ok, timerfd:close(Timer)).
+
+setopts_test() ->
+    {ok, Timer} = timerfd:create(clock_monotonic),
+    ?assertEqual(ok, timerfd:setopts(Timer, [{priority, 1}])),
+    ?assertEqual(ok, timerfd:setopts(Timer, [{priority, undefined}])),
+    ?assertError(badarg, timerfd:setopts(Timer, [{notanoption, 1}])),
+    ?assertMatch(ok, timerfd:close(Timer)).
+
+collect_ready_test() ->
+    {ok, Low} = timerfd:create(clock_monotonic),
+    {ok, High} = timerfd:create(clock_monotonic),
+    ok = timerfd:setopts(Low, [{priority, 1}]),
+    ok = timerfd:setopts(High, [{priority, 10}]),
+    {ok, _} = timerfd:set_time(Low, {{0,0},{0,1000000}}),
+    {ok, _} = timerfd:set_time(High, {{0,0},{0,2000000}}),
+    timer:sleep(10),
+    ?assertMatch({ok, [{High, 10, _}, {Low, 1, _}]},
+                 timerfd:collect_ready(1000)),
+    ?assertEqual(timeout, timerfd:collect_ready(0)),
+    ?assert(proplists:get_value(reordered, timerfd:ready_stats()) >= 1),
+    ok = timerfd:close(Low),
+    ok = timerfd:close(High).
+
+export_metrics_test() ->
+    Path = "timerfd_test.prom",
+    {ok, Timer} = timerfd:create(clock_monotonic),
+    ok = timerfd:setopts(Timer, [{name, control}, {lateness_slo, 1000}]),
+    ?assertEqual(ok, timerfd:export_metrics({file, Path, 10})),
+    ?assertMatch({error, _}, timerfd:export_metrics({file, Path, 10})),
+    timer:sleep(50),
+    {ok, Metrics} = file:read_file(Path),
+    ?assertMatch({match, _},
+                 re:run(Metrics, "timerfd_ticks_total\\{id=\"[0-9]+\","
+                                 "name=\"control\"\\} 0")),
+    ?assertMatch({match, _}, re:run(Metrics, "# EOF\n$")),
+    ?assertEqual(ok, timerfd:export_metrics(stop)),
+    %% Stopping again must not drop the reference create/1 took
+    ?assertEqual({error, "not running"}, timerfd:export_metrics(stop)),
+    ?assertMatch({ok, _}, timerfd:stats(Timer)),
+    %% A file that is not a socket is left alone
+    ?assertMatch({error, _}, timerfd:export_metrics({unix, Path})),
+    ?assertMatch({ok, _}, file:read_file(Path)),
+    ok = timerfd:close(Timer),
+    file:delete(Path).
+
+export_owner_exit_test() ->
+    Path = "timerfd_owner_test.prom",
+    {Starter, MRef} =
+        spawn_monitor(fun() -> ok = timerfd:export_metrics({file, Path, 10})
+                      end),
+    receive {'DOWN', MRef, process, Starter, normal} -> ok end,
+    %% The export ends with the process that started it
+    case whereis(timerfd_exporter) of
+        undefined ->
+            ok;
+        Owner ->
+            OwnerRef = monitor(process, Owner),
+            receive {'DOWN', OwnerRef, process, Owner, _} -> ok end
+    end,
+    ?assertEqual({error, "not running"}, timerfd:export_metrics(stop)),
+    ?assertEqual(ok, timerfd:export_metrics({file, Path, 10})),
+    ?assertEqual(ok, timerfd:export_metrics(stop)),
+    file:delete(Path).
+
+set_schedule_test() ->
+    {ok, Timer} = timerfd:create(clock_monotonic),
+    Intervals = [1000000, 2000000, 500000],
+    Start = monotonic_time(nano_seconds),
+    ?assertEqual(ok, timerfd:set_schedule(Timer, Intervals, false)),
+    lists:foreach(fun(_) ->
+                          receive
+                              {Timer, {data, _}} ->
+                                  ?assertEqual({ok, 1}, timerfd:read(Timer))
+                          after
+                              1000 ->
+                                  throw("timeout waiting for message")
+                          end
+                  end, Intervals),
+    ?assert(monotonic_time(nano_seconds) - Start >= lists:sum(Intervals)),
+    ?assertMatch({ok, {{0,0},{0,0}}}, timerfd:get_time(Timer)),
+    ?assertError(badarg, timerfd:set_schedule(Timer, [1000000, -1], false)),
+    ?assertError(badarg, timerfd:set_schedule(Timer, [1.5e6], false)),
+    ?assertMatch(ok, timerfd:close(Timer)).
+
+inject_test() ->
+    {ok, Timer} = timerfd:create(clock_monotonic),
+    ?assertEqual(ok, timerfd:setopts(Timer, [{inject, [{seed, 42},
+                                                       {drop, 0.5},
+                                                       {burst, 1.0, 2}]}])),
+    {ok, _} = timerfd:set_time(Timer, {0,1000000}),
+    receive
+        {Timer, {data, _}} ->
+            {ok, Expirations} = timerfd:read(Timer),
+            ?assert(Expirations >= 3)
+    after
+        1000 ->
+            throw("timeout waiting for message")
+    end,
+    {ok, Stats} = timerfd:stats(Timer),
+    ?assert(proplists:get_value(inject_bursts, Stats) >= 1),
+    ?assertEqual(ok, timerfd:setopts(Timer, [{inject, off}])),
+    ?assertError(badarg, timerfd:setopts(Timer, [{inject, [{drop}]}])),
+    ?assertError(badarg, timerfd:setopts(Timer, [{inject, [{drop, 1.5}]}])),
+    ?assertError(badarg,
+                 timerfd:setopts(Timer, [{inject, [{burst, -0.1, 1}]}])),
+    ?assertMatch(ok, timerfd:close(Timer)).
+
+inject_delay_test() ->
+    {ok, Timer} = timerfd:create(clock_monotonic),
+    ok = timerfd:setopts(Timer, [{inject, [{delay, {uniform, 5000, 5000}}]}]),
+    Start = monotonic_time(micro_seconds),
+    {ok, _} = timerfd:set_time(Timer, {{0,0},{0,1000000}}),
+    receive
+        {Timer, {data, _}} ->
+            ?assert(monotonic_time(micro_seconds) - Start >= 6000)
+    after
+        1000 ->
+            throw("timeout waiting for message")
+    end,
+    ?assertMatch(ok, timerfd:close(Timer)).
+
+analyze_test() ->
+    Samples = [10 * math:sin(2 * math:pi() * N / 8) || N <- lists:seq(0, 4095)],
+    {ok, [{Period, Amplitude, Share} | _]} = timerfd:analyze(Samples, 3),
+    ?assert(abs(Period - 8.0) < 0.1),
+    ?assert(abs(Amplitude - 10.0) < 0.5),
+    ?assert(Share > 0.9),
+    ?assertEqual({ok, []}, timerfd:analyze([], 3)).
+
+
+%% Subscribes an eventfd through the native ABI from a bare driver port
+native_subscriber_test() ->
+    {ok, Timer} = timerfd:create(clock_monotonic),
+    ok = timerfd:setopts(Timer, [{name, native_subscriber_test}]),
+    {ok, Probe, Handle} = timerfd:probe(native_subscriber_test),
+    {ok, Stats} = timerfd:stats(Timer),
+    ?assertEqual(1, proplists:get_value(native_subscribers, Stats)),
+    {ok, _} = timerfd:set_time(Timer, {0, 1000000}),
+    receive
+        {Timer, {data, _}} -> ok
+    after
+        1000 -> throw("timeout waiting for message")
+    end,
+    %% Without reads from the owner the driver keeps reading the timer
+    timer:sleep(20),
+    %% The eventfd is written before the call is counted, so reading the
+    %% count first keeps it at or below what was signalled
+    {ok, [{Handle, Calls, _, _}]} = timerfd:subscribers(Timer),
+    {ok, Signalled} = timerfd:drain_probe(Probe),
+    ?assert(Calls > 1),
+    ?assert(Signalled >= Calls),
+    %% Disarming drops unread expirations, so every expiration left for
+    %% read/1 went through the subscriber as well
+    {ok, _} = timerfd:set_time(Timer, {{0,0},{0,0}}),
+    {ok, Rest} = timerfd:drain_probe(Probe),
+    ?assertEqual({ok, Signalled + Rest}, timerfd:read(Timer)),
+    ok = timerfd:close(Timer),
+    ok = timerfd:close(Probe).
+
+subscribers_test() ->
+    {ok, Timer} = timerfd:create(clock_monotonic),
+    ?assertEqual({ok, []}, timerfd:subscribers(Timer)),
+    {ok, Stats} = timerfd:stats(Timer),
+    ?assertEqual(0, proplists:get_value(native_subscribers, Stats)),
+    ok = timerfd:close(Timer).
+
+pm_qos_test() ->
+    {ok, Timer} = timerfd:create(clock_monotonic),
+    ok = timerfd:setopts(Timer, [{pm_qos, 10}]),
+    {ok, _} = timerfd:set_time(Timer, {{0,1000000},{0,1000000}}),
+    {ok, Stats} = timerfd:stats(Timer),
+    %% Without permission to write the file the timer runs without the hint
+    case proplists:get_value(pm_qos_active, Stats) of
+        true -> ?assertEqual(10, proplists:get_value(pm_qos_target, Stats));
+        false -> ?assert(proplists:get_value(pm_qos_errno, Stats) > 0)
+    end,
+    {ok, _} = timerfd:set_time(Timer, {{0,0},{0,0}}),
+    {ok, Disarmed} = timerfd:stats(Timer),
+    ?assertEqual(false, proplists:get_value(pm_qos_active, Disarmed)),
+    ?assertEqual(ok, timerfd:setopts(Timer, [{pm_qos, false}])),
+    ?assertError(badarg, timerfd:setopts(Timer, [{pm_qos, -1}])),
+    ok = timerfd:close(Timer).
+
+%% Long series are averaged over segments
+analyze_long_test() ->
+    Samples = [10 * math:sin(2 * math:pi() * N / 8)
+               + 3 * math:sin(2 * math:pi() * N / 100)
+               || N <- lists:seq(0, 99999)],
+    {ok, [{P1, A1, _}, {P2, A2, _} | _]} = timerfd:analyze(Samples, 2),
+    ?assert(abs(P1 - 8.0) < 0.1),
+    ?assert(abs(A1 - 10.0) < 0.5),
+    ?assert(abs(P2 - 100.0) < 1.0),
+    ?assert(abs(A2 - 3.0) < 0.5).
+
+%% A tick held back by injection is dropped when the timer is closed
+inject_close_test() ->
+    {ok, Timer} = timerfd:create(clock_monotonic),
+    ok = timerfd:setopts(Timer, [{inject, [{delay, {uniform, 50000, 50000}}]}]),
+    {ok, _} = timerfd:set_time(Timer, {{0,0},{0,1000000}}),
+    timer:sleep(10),
+    ok = timerfd:close(Timer),
+    receive
+        {Timer, _} -> throw("unexpected message")
+    after
+        100 -> ok
+    end.
+
+set_interval_test() ->
+    {ok, Timer} = timerfd:create(clock_monotonic),
+    {ok, _} = timerfd:set_interval(Timer, 1500000),
+    ?assertMatch({ok, {{1, 500000000}, _}}, timerfd:get_time(Timer)),
+    {ok, _} = timerfd:set_interval(Timer, 0),
+    ?assertEqual({ok, {{0, 0}, {0, 0}}}, timerfd:get_time(Timer)),
+    ok = timerfd:close(Timer).
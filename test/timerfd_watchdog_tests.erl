@@ -0,0 +1,88 @@
+%%%============================================================================
+%%% Copyright (c) 2016, Mark Jones <markalanj@gmail.com>.
+%%% All rights reserved.
+%%%
+%%% Redistribution and use in source and binary forms, with or without
+%%% modification, are permitted provided that the following conditions are
+%%% met:
+%%%
+%%% * Redistributions of source code must retain the above copyright
+%%%   notice, this list of conditions and the following disclaimer.
+%%%
+%%% * Redistributions in binary form must reproduce the above copyright
+%%%   notice, this list of conditions and the following disclaimer in the
+%%%   documentation and/or other materials provided with the distribution.
+%%%
+%%% * The names of its contributors may not be used to endorse or promote
+%%%   products derived from this software without specific prior written
+%%%   permission.
+%%%
+%%% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+%%% "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+%%% LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+%%% A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+%%% OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+%%% SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+%%% LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+%%% DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+%%% THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+%%% (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+%%% OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+%%%============================================================================
+
+-module(timerfd_watchdog_tests).
+
+-include_lib("eunit/include/eunit.hrl").
+
+late_test() ->
+    {ok, Watchdog} = timerfd_watchdog:start_link(self(), [{resolution, 100}]),
+    {ok, Ref} = timerfd_watchdog:watch(Watchdog, self(), 5000),
+    ok = timerfd_watchdog:kick(Ref),
+    Self = self(),
+    receive
+        {timerfd_watchdog, Ref, Self, late, LateBy} ->
+            ?assert(LateBy >= 0)
+    after
+        1000 ->
+            throw("timeout waiting for message")
+    end,
+    ok = timerfd_watchdog:stop(Watchdog).
+
+kick_test() ->
+    {ok, Watchdog} = timerfd_watchdog:start_link(self(), [{resolution, 100}]),
+    {ok, Ref} = timerfd_watchdog:watch(Watchdog, self(), 20000),
+    lists:foreach(fun(_) ->
+                          timer:sleep(2),
+                          ok = timerfd_watchdog:kick(Ref)
+                  end, lists:seq(1, 20)),
+    ok = timerfd_watchdog:unwatch(Ref),
+    receive
+        {timerfd_watchdog, Ref, _, late, _} -> throw("unexpected late")
+    after
+        0 -> ok
+    end,
+    ok = timerfd_watchdog:stop(Watchdog).
+
+full_test() ->
+    {ok, Watchdog} = timerfd_watchdog:start_link(self(), [{capacity, 1}]),
+    {ok, _} = timerfd_watchdog:watch(Watchdog, self(), 1000000),
+    ?assertEqual({error, full}, timerfd_watchdog:watch(Watchdog, self(), 1)),
+    ok = timerfd_watchdog:stop(Watchdog).
+
+rearm_test() ->
+    {ok, Watchdog} = timerfd_watchdog:start_link(self(), [{resolution, 100}]),
+    {ok, Ref} = timerfd_watchdog:watch(Watchdog, self(), 2000),
+    lists:foreach(fun(_) ->
+                          receive
+                              {timerfd_watchdog, Ref, _, late, _} ->
+                                  ok = timerfd_watchdog:kick(Ref)
+                          after
+                              1000 -> throw("timeout waiting for message")
+                          end
+                  end, lists:seq(1, 3)),
+    ok = timerfd_watchdog:stop(Watchdog).
+
+resolution_test() ->
+    {ok, Watchdog} = timerfd_watchdog:start_link(self(),
+                                                 [{resolution, 1500000}]),
+    ok = timerfd_watchdog:stop(Watchdog).